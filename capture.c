@@ -0,0 +1,229 @@
+/*
+ *  Asynchronous frame capture
+ *
+ *  Each frame is read into the next of a ring of pixel buffer objects, which
+ *  returns at once.  The buffer read CAPRING-1 frames earlier has finished by
+ *  then, so it is mapped and copied into a slot of a bounded queue without
+ *  stalling the pipeline.  A writer thread converts the queued frames and
+ *  writes them as a Y4M stream (4:4:4, BT.601) or a PPM sequence.  When the
+ *  writer falls behind and the queue is full frames are dropped and counted.
+ */
+#include "water.h"
+
+/*
+ *  Write one frame (RGB rows bottom to top as read by OpenGL)
+ */
+static void WriteFrame(struct frameCapture* c,const unsigned char* rgb,int n)
+{
+   int i,j,w=c->w,h=c->h;
+   if (c->y4m)
+   {
+      //  Planar Y, U and V with the rows flipped
+      unsigned char* Y = c->line;
+      unsigned char* U = Y+w*h;
+      unsigned char* V = U+w*h;
+      for (j=0;j<h;j++)
+      {
+         const unsigned char* p = rgb+3*w*(h-1-j);
+         for (i=0;i<w;i++,p+=3)
+         {
+            int R=p[0],G=p[1],B=p[2];
+            *Y++ = (( 66*R+129*G+ 25*B+128)>>8)+16;
+            *U++ = ((-38*R- 74*G+112*B+128)>>8)+128;
+            *V++ = ((112*R- 94*G- 18*B+128)>>8)+128;
+         }
+      }
+      if (fputs("FRAME\n",c->f)<0 || fwrite(c->line,3*w*h,1,c->f)!=1)
+         c->errors++;
+   }
+   else
+   {
+      char name[1024];
+      FILE* f;
+      snprintf(name,sizeof(name),c->name,n);
+      f = fopen(name,"wb");
+      if (!f)
+      {
+         c->errors++;
+         return;
+      }
+      fprintf(f,"P6\n%d %d\n255\n",w,h);
+      for (j=h-1;j>=0;j--)
+         if (fwrite(rgb+3*w*j,3*w,1,f)!=1)
+         {
+            c->errors++;
+            break;
+         }
+      fclose(f);
+   }
+}
+
+/*
+ *  Writer thread
+ *     takes frames from the head of the queue until the capture is closed and the queue is empty
+ */
+static void* Writer(void* arg)
+{
+   struct frameCapture* c = (struct frameCapture*)arg;
+   pthread_mutex_lock(&c->lock);
+   while (1)
+   {
+      while (!c->nqueue && !c->done)
+         pthread_cond_wait(&c->ready,&c->lock);
+      if (!c->nqueue) break;
+      //  The head slot is not reused until it is released below
+      int k = c->qhead;
+      int n = c->written;
+      pthread_mutex_unlock(&c->lock);
+      double t0 = Now();
+      WriteFrame(c,c->slot[k],n);
+      double dt = Now()-t0;
+      pthread_mutex_lock(&c->lock);
+      c->writetime += dt;
+      c->written++;
+      c->qhead = (c->qhead+1)%CAPQUEUE;
+      c->nqueue--;
+   }
+   pthread_mutex_unlock(&c->lock);
+   return NULL;
+}
+
+/*
+ *  Start capturing w x h frames to file
+ *     files ending in .y4m are a Y4M stream at fps frames per second, others are
+ *     a PPM sequence named with file as a printf pattern (or file followed by the frame number)
+ */
+struct frameCapture* CaptureCreate(const char* file,int w,int h,int fps)
+{
+   int k,size=3*w*h;
+   size_t len = strlen(file);
+   struct frameCapture* c = (struct frameCapture*)calloc(1,sizeof(struct frameCapture));
+   if (!c) Fatal("Cannot allocate frame capture\n");
+   c->w = w;
+   c->h = h;
+   c->y4m = len>4 && !strcmp(file+len-4,".y4m");
+   c->name = (char*)malloc(len+16);
+   if (!c->name) Fatal("Cannot allocate frame capture\n");
+   if (c->y4m || strchr(file,'%'))
+      strcpy(c->name,file);
+   else
+      sprintf(c->name,"%s%%05d.ppm",file);
+   if (c->y4m)
+   {
+      c->f = fopen(file,"wb");
+      if (!c->f) Fatal("Cannot open capture file %s\n",file);
+      fprintf(c->f,"YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",w,h,fps);
+      c->line = (unsigned char*)malloc(size);
+      if (!c->line) Fatal("Cannot allocate %d byte capture buffer\n",size);
+   }
+   //  Queue slots
+   for (k=0;k<CAPQUEUE;k++)
+   {
+      c->slot[k] = (unsigned char*)malloc(size);
+      if (!c->slot[k]) Fatal("Cannot allocate %d byte capture buffer\n",size);
+   }
+   //  Readback ring
+   glGenBuffers(CAPRING,c->pbo);
+   for (k=0;k<CAPRING;k++)
+   {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER,c->pbo[k]);
+      glBufferData(GL_PIXEL_PACK_BUFFER,size,NULL,GL_STREAM_READ);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+   pthread_mutex_init(&c->lock,NULL);
+   pthread_cond_init(&c->ready,NULL);
+   if (pthread_create(&c->thread,NULL,Writer,c)) Fatal("Cannot start capture thread\n");
+   return c;
+}
+
+/*
+ *  Queue the frame held in PBO k
+ */
+static void Collect(struct frameCapture* c,int k)
+{
+   glBindBuffer(GL_PIXEL_PACK_BUFFER,c->pbo[k]);
+   unsigned char* p = (unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER,GL_READ_ONLY);
+   if (p)
+   {
+      pthread_mutex_lock(&c->lock);
+      int full = c->nqueue==CAPQUEUE;
+      int tail = (c->qhead+c->nqueue)%CAPQUEUE;
+      pthread_mutex_unlock(&c->lock);
+      //  The tail slot belongs to this thread until it is counted in the queue
+      if (full)
+         c->dropped++;
+      else
+      {
+         memcpy(c->slot[tail],p,3*c->w*c->h);
+         pthread_mutex_lock(&c->lock);
+         c->nqueue++;
+         pthread_cond_signal(&c->ready);
+         pthread_mutex_unlock(&c->lock);
+      }
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+   }
+   else
+      c->dropped++;
+   glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+}
+
+/*
+ *  Capture the frame in the back buffer
+ *     frames of a different size than the capture (window resized) are dropped
+ */
+void CaptureFrame(struct frameCapture* c,int w,int h)
+{
+   double t0 = Now();
+   int k = c->issued%CAPRING;
+   if (!c->frames) c->start = t0;
+   c->frames++;
+   if (w!=c->w || h!=c->h)
+   {
+      c->dropped++;
+      return;
+   }
+   //  The oldest read has had CAPRING-1 frames to finish
+   if (c->issued>=CAPRING) Collect(c,k);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER,c->pbo[k]);
+   glPixelStorei(GL_PACK_ALIGNMENT,1);
+   glReadBuffer(GL_BACK);
+   glReadPixels(0,0,w,h,GL_RGB,GL_UNSIGNED_BYTE,NULL);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+   c->issued++;
+   c->last = Now();
+   c->readtime += c->last-t0;
+}
+
+/*
+ *  Finish the capture
+ *     collects the reads still in flight, waits for the writer and reports
+ */
+void CaptureClose(struct frameCapture* c)
+{
+   int k;
+   if (!c) return;
+   for (k=c->issued<CAPRING ? 0 : c->issued-CAPRING;k<c->issued;k++)
+      Collect(c,k%CAPRING);
+   pthread_mutex_lock(&c->lock);
+   c->done = 1;
+   pthread_cond_signal(&c->ready);
+   pthread_mutex_unlock(&c->lock);
+   pthread_join(c->thread,NULL);
+   if (c->f) fclose(c->f);
+   if (c->frames)
+   {
+      double span = c->last-c->start;
+      fprintf(stderr,"Capture: %d frames, %d written, %d dropped, %d write errors\n",c->frames,c->written,c->dropped,c->errors);
+      fprintf(stderr,"Capture: %.3f ms/frame on the render thread (%.1f%% of %.2f ms frames), %.3f ms/frame writing\n",
+         c->readtime/c->frames,c->frames>1 ? 100*c->readtime/span : 0.0,c->frames>1 ? span/(c->frames-1) : 0.0,
+         c->written ? c->writetime/c->written : 0.0);
+   }
+   glDeleteBuffers(CAPRING,c->pbo);
+   pthread_mutex_destroy(&c->lock);
+   pthread_cond_destroy(&c->ready);
+   for (k=0;k<CAPQUEUE;k++)
+      free(c->slot[k]);
+   free(c->line);
+   free(c->name);
+   free(c);
+}
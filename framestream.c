@@ -0,0 +1,259 @@
+/*
+ *  Surface frame stream export and replay
+ *
+ *  Each frame is a quantized copy of the surface (an array of shorts).
+ *  Every short is stored as the difference to the same short in the previous
+ *  frame, zigzag mapped so small changes of either sign are small numbers,
+ *  and written as a 1-3 byte varint.  Every keyint frames the difference is
+ *  taken against zero so a frame can be reached without decoding the whole file.
+ *  An index of frame offsets and times is appended when the stream is closed.
+ *  Frame times must increase, since replay searches the index by time.
+ *  Files are written in native byte order.
+ */
+#include "water.h"
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define KEYINT 30  //  Default frames between key frames
+
+/*
+ *  Encode the difference between two frames
+ */
+static int Encode(const short* frame,const short* prev,int n,unsigned char* out)
+{
+   int k;
+   unsigned char* p = out;
+   for (k=0;k<n;k++)
+   {
+      short d = (short)(frame[k] - (prev ? prev[k] : 0));
+      unsigned int z = (unsigned short)((d<<1) ^ (d>>15));
+      while (z>=0x80)
+      {
+         *p++ = z | 0x80;
+         z >>= 7;
+      }
+      *p++ = z;
+   }
+   return p-out;
+}
+
+/*
+ *  Apply an encoded difference of size bytes to a frame in place
+ */
+static void Decode(const unsigned char* p,int size,int n,int key,short* frame)
+{
+   int k;
+   const unsigned char* end = p+size;
+   for (k=0;k<n;k++)
+   {
+      unsigned int z,sh=7;
+      if (p>=end) Fatal("Stream frame is truncated\n");
+      z = *p & 0x7F;
+      while (*p++ & 0x80)
+      {
+         if (p>=end || sh>14) Fatal("Stream frame is corrupt\n");
+         z |= (*p & 0x7F) << sh;
+         sh += 7;
+      }
+      z &= 0xFFFF;
+      short d = (short)((z>>1) ^ -(int)(z&1));
+      frame[k] = key ? d : (short)(frame[k]+d);
+   }
+}
+
+/*
+ *  Create a stream for writing
+ */
+struct frameStream* StreamCreate(const char* file,int gridn,int nfield,double dim,double qstep,double drange,double hrange)
+{
+   struct frameStream* s = (struct frameStream*)calloc(1,sizeof(struct frameStream));
+   if (!s) Fatal("Cannot allocate frame stream\n");
+   memcpy(s->hdr.magic,"WSS1",4);
+   s->hdr.gridn  = gridn;
+   s->hdr.nfield = nfield;
+   s->hdr.keyint = KEYINT;
+   s->hdr.dim    = dim;
+   s->hdr.qstep  = qstep;
+   s->hdr.drange = drange;
+   s->hdr.hrange = hrange;
+   s->count = gridn*gridn*nfield;
+   s->prev = (short*)malloc(s->count*sizeof(short));
+   s->buf  = (unsigned char*)malloc(3*s->count);
+   if (!s->prev || !s->buf) Fatal("Cannot allocate %d byte frame buffers\n",5*s->count);
+   s->f = fopen(file,"wb");
+   if (!s->f) Fatal("Cannot open stream file %s\n",file);
+   //  Header is rewritten with the index offset on close
+   if (fwrite(&s->hdr,sizeof(s->hdr),1,s->f)!=1) Fatal("Cannot write stream header to %s\n",file);
+   return s;
+}
+
+/*
+ *  Append a frame to the stream
+ *     frames at or before the time of the last frame (paused or scrubbed back) are skipped
+ */
+void StreamWrite(struct frameStream* s,const short* frame,double t)
+{
+   int n = s->hdr.nframes;
+   int key = (n%s->hdr.keyint)==0;
+   clock_t t0;
+   if (n && t<=s->index[n-1].t)
+   {
+      s->skipped++;
+      return;
+   }
+   t0 = clock();
+   int size = Encode(frame,key ? NULL : s->prev,s->count,s->buf);
+   memcpy(s->prev,frame,s->count*sizeof(short));
+   s->enctime += (double)(clock()-t0)/CLOCKS_PER_SEC;
+
+   //  Grow index
+   if (n==s->nalloc)
+   {
+      s->nalloc = s->nalloc ? 2*s->nalloc : 1024;
+      s->index = (struct streamIndex*)realloc(s->index,s->nalloc*sizeof(struct streamIndex));
+      if (!s->index) Fatal("Cannot allocate stream index for %d frames\n",s->nalloc);
+   }
+   s->index[n].offset = ftell(s->f);
+   s->index[n].size   = size;
+   s->index[n].key    = key;
+   s->index[n].t      = t;
+   if (fwrite(s->buf,size,1,s->f)!=1) Fatal("Cannot write frame %d to stream\n",n);
+   s->hdr.nframes++;
+}
+
+/*
+ *  Open a stream for replay
+ */
+struct frameStream* StreamOpen(const char* file)
+{
+   int k;
+   struct frameStream* s = (struct frameStream*)calloc(1,sizeof(struct frameStream));
+   if (!s) Fatal("Cannot allocate frame stream\n");
+#ifndef _WIN32
+   //  Map the whole file
+   struct stat st;
+   int fd = open(file,O_RDONLY);
+   if (fd<0 || fstat(fd,&st)) Fatal("Cannot open stream file %s\n",file);
+   s->size = st.st_size;
+   s->map = (unsigned char*)mmap(NULL,s->size,PROT_READ,MAP_PRIVATE,fd,0);
+   close(fd);
+   if (s->map==MAP_FAILED) Fatal("Cannot map stream file %s\n",file);
+#else
+   //  No mmap, read the whole file
+   FILE* f = fopen(file,"rb");
+   if (!f) Fatal("Cannot open stream file %s\n",file);
+   fseek(f,0,SEEK_END);
+   s->size = ftell(f);
+   rewind(f);
+   s->map = (unsigned char*)malloc(s->size);
+   if (!s->map || fread(s->map,s->size,1,f)!=1) Fatal("Cannot read stream file %s\n",file);
+   fclose(f);
+#endif
+   if (s->size<sizeof(s->hdr)) Fatal("%s is not a surface stream\n",file);
+   memcpy(&s->hdr,s->map,sizeof(s->hdr));
+   if (memcmp(s->hdr.magic,"WSS1",4)) Fatal("%s is not a surface stream\n",file);
+   if (s->hdr.nframes<1 || s->hdr.index<sizeof(s->hdr) || s->hdr.index%8 ||
+       s->hdr.index>s->size || (s->size-s->hdr.index)/sizeof(struct streamIndex)<(uint64_t)s->hdr.nframes)
+      Fatal("%s has no frame index (recording not closed?)\n",file);
+   //  Header fields the replay relies on
+   if (s->hdr.gridn<2 || s->hdr.gridn>4096 || s->hdr.nfield<1 || s->hdr.nfield>16 || s->hdr.keyint<1 ||
+       !(s->hdr.dim>0) || !(s->hdr.qstep>0) || !(s->hdr.drange>0) || !(s->hdr.hrange>0))
+      Fatal("%s has an invalid stream header\n",file);
+   s->index = (struct streamIndex*)(s->map+s->hdr.index);
+   s->count = s->hdr.gridn*s->hdr.gridn*s->hdr.nfield;
+   //  Every frame must lie between the header and the index, key frames where the reader expects them
+   for (k=0;k<s->hdr.nframes;k++)
+   {
+      struct streamIndex* e = &s->index[k];
+      if (e->offset<sizeof(s->hdr) || e->offset>s->hdr.index || e->size>s->hdr.index-e->offset)
+         Fatal("%s frame %d lies outside the frame data\n",file,k);
+      if (e->size<(uint32_t)s->count || (k%s->hdr.keyint==0 && !e->key) || (k && !(e->t>=e[-1].t)))
+         Fatal("%s frame %d is invalid\n",file,k);
+   }
+   s->prev = (short*)malloc(s->count*sizeof(short));
+   if (!s->prev) Fatal("Cannot allocate %d byte frame buffer\n",2*s->count);
+   s->cur = -1;
+   return s;
+}
+
+/*
+ *  Find the last frame at or before time t
+ *     t wraps around the recorded time span so replay loops
+ */
+int StreamFind(struct frameStream* s,double t)
+{
+   int lo=0,hi=s->hdr.nframes-1;
+   double t0 = s->index[0].t;
+   double span = s->index[hi].t - t0;
+   if (t>s->index[hi].t && span>0) t = t0+fmod(t-t0,span);
+   //  Binary search for the last frame with index[k].t <= t
+   while (lo<hi)
+   {
+      int mid = (lo+hi+1)/2;
+      if (s->index[mid].t<=t)
+         lo = mid;
+      else
+         hi = mid-1;
+   }
+   return lo;
+}
+
+/*
+ *  Decode frame k
+ *     consecutive frames apply one delta, otherwise decode from the preceding key frame
+ */
+void StreamRead(struct frameStream* s,int k,short* frame)
+{
+   int i;
+   if (k<0 || k>=s->hdr.nframes) Fatal("Stream frame %d out of range\n",k);
+   if (k!=s->cur)
+   {
+      i = (k==s->cur+1) ? k : k-k%s->hdr.keyint;
+      for (;i<=k;i++)
+         Decode(s->map+s->index[i].offset,s->index[i].size,s->count,s->index[i].key,s->prev);
+      s->cur = k;
+   }
+   memcpy(frame,s->prev,s->count*sizeof(short));
+}
+
+/*
+ *  Close a stream
+ *     writers append the index and report the compression
+ */
+void StreamClose(struct frameStream* s)
+{
+   if (!s) return;
+   if (s->f)
+   {
+      int n = s->hdr.nframes;
+      //  Align the index so it can be used in place when mapped
+      while (ftell(s->f)%8) fputc(0,s->f);
+      s->hdr.index = ftell(s->f);
+      if (n && fwrite(s->index,sizeof(struct streamIndex),n,s->f)!=n) Fatal("Cannot write stream index\n");
+      rewind(s->f);
+      if (fwrite(&s->hdr,sizeof(s->hdr),1,s->f)!=1) Fatal("Cannot write stream header\n");
+      fclose(s->f);
+      if (n)
+         fprintf(stderr,"Stream: %d frames, %.1f bytes/frame (raw %d), encode %.3f ms/frame\n",
+            n,(double)(s->hdr.index-sizeof(s->hdr))/n,(int)(s->count*sizeof(short)),1000*s->enctime/n);
+      if (s->skipped)
+         fprintf(stderr,"Stream: %d frames skipped (time did not advance)\n",s->skipped);
+      free(s->index);
+      free(s->buf);
+   }
+   else
+   {
+#ifndef _WIN32
+      munmap(s->map,s->size);
+#else
+      free(s->map);
+#endif
+   }
+   free(s->prev);
+   free(s);
+}
@@ -0,0 +1,183 @@
+/*
+ *  Redundant OpenGL state filter
+ *
+ *  Remembers the last value set for the states display() sets every frame
+ *  and only passes changes on to OpenGL.  All changes of these states must
+ *  go through these functions, StReset() forgets everything after untracked
+ *  calls.  Calls passed on and skipped are counted per frame.
+ */
+#include "water.h"
+
+#define MAXSTATE 32  //  Tracked states of each kind
+
+//  Enable/disable capabilities (texture targets per texture unit)
+static struct {GLenum cap,unit; int on;} cap[MAXSTATE];
+static int ncap=0;
+//  Light and material vectors
+static struct {GLenum which,pname; float v[4];} vec[MAXSTATE];
+static int nvec=0;
+//  Single valued states (shade model, light model, color material, program, textures)
+static struct {GLenum which,pname; unsigned int v;} val[MAXSTATE];
+static int nval=0;
+
+static int issued=0,skipped=0;
+static GLenum unit=GL_TEXTURE0;  //  Active texture unit
+
+/*
+ *  Check a single valued state and remember the new value
+ *     returns 1 if the call must be issued
+ */
+static int Changed(GLenum which,GLenum pname,unsigned int v)
+{
+   int k;
+   for (k=0;k<nval;k++)
+      if (val[k].which==which && val[k].pname==pname)
+      {
+         if (val[k].v==v)
+         {
+            skipped++;
+            return 0;
+         }
+         val[k].v = v;
+         issued++;
+         return 1;
+      }
+   if (nval<MAXSTATE)
+   {
+      val[nval].which = which;
+      val[nval].pname = pname;
+      val[nval].v = v;
+      nval++;
+   }
+   issued++;
+   return 1;
+}
+
+/*
+ *  Check a vector state of n floats and remember the new value
+ */
+static int ChangedV(GLenum which,GLenum pname,const float* v,int n)
+{
+   int k;
+   for (k=0;k<nvec;k++)
+      if (vec[k].which==which && vec[k].pname==pname)
+      {
+         if (!memcmp(vec[k].v,v,n*sizeof(float)))
+         {
+            skipped++;
+            return 0;
+         }
+         memcpy(vec[k].v,v,n*sizeof(float));
+         issued++;
+         return 1;
+      }
+   if (nvec<MAXSTATE)
+   {
+      vec[nvec].which = which;
+      vec[nvec].pname = pname;
+      memcpy(vec[nvec].v,v,n*sizeof(float));
+      nvec++;
+   }
+   issued++;
+   return 1;
+}
+
+/*
+ *  glEnable/glDisable
+ *     texture target enables apply to the active texture unit
+ */
+void StEnable(GLenum c,int on)
+{
+   int k;
+   GLenum u = (c==GL_TEXTURE_1D || c==GL_TEXTURE_2D || c==GL_TEXTURE_3D || c==GL_TEXTURE_CUBE_MAP) ? unit : 0;
+   for (k=0;k<ncap && (cap[k].cap!=c || cap[k].unit!=u);k++);
+   if (k<ncap && cap[k].on==on)
+   {
+      skipped++;
+      return;
+   }
+   if (k<ncap)
+      cap[k].on = on;
+   else if (ncap<MAXSTATE)
+   {
+      cap[ncap].cap = c;
+      cap[ncap].unit = u;
+      cap[ncap].on = on;
+      ncap++;
+   }
+   issued++;
+   if (on)
+      glEnable(c);
+   else
+      glDisable(c);
+}
+
+/*
+ *  glLightfv for 4 component parameters
+ *     GL_POSITION is stored in eye coordinates when it is set, so it is
+ *     only filtered if the caller knows the modelview matrix is unchanged
+ */
+void StLightfv(GLenum light,GLenum pname,const float* v)
+{
+   if (ChangedV(light,pname,v,4)) glLightfv(light,pname,v);
+}
+
+/*
+ *  glMaterialfv (GL_SHININESS has one component, the others four)
+ */
+void StMaterialfv(GLenum face,GLenum pname,const float* v)
+{
+   if (ChangedV(face,pname,v,pname==GL_SHININESS ? 1 : 4)) glMaterialfv(face,pname,v);
+}
+
+void StLightModeli(GLenum pname,int v)
+{
+   if (Changed(GL_LIGHT_MODEL_LOCAL_VIEWER,pname,v)) glLightModeli(pname,v);
+}
+
+void StColorMaterial(GLenum face,GLenum mode)
+{
+   if (Changed(GL_COLOR_MATERIAL,face,mode)) glColorMaterial(face,mode);
+}
+
+void StShadeModel(GLenum mode)
+{
+   if (Changed(GL_SHADE_MODEL,0,mode)) glShadeModel(mode);
+}
+
+void StUseProgram(unsigned int prog)
+{
+   if (Changed(GL_CURRENT_PROGRAM,0,prog)) glUseProgram(prog);
+}
+
+void StActiveTexture(GLenum u)
+{
+   unit = u;
+   if (Changed(GL_ACTIVE_TEXTURE,0,u)) glActiveTexture(u);
+}
+
+/*
+ *  glBindTexture on the active texture unit
+ */
+void StBindTexture(GLenum target,unsigned int tex)
+{
+   if (Changed(unit,target,tex)) glBindTexture(target,tex);
+}
+
+/*
+ *  Forget all states
+ */
+void StReset()
+{
+   ncap = nvec = nval = 0;
+}
+
+/*
+ *  Calls issued and skipped since the last call
+ */
+void StFrame(int* nissued,int* nskipped)
+{
+   *nissued = issued;
+   *nskipped = skipped;
+   issued = skipped = 0;
+}
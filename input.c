@@ -0,0 +1,192 @@
+/*
+ *  Input event record and replay
+ *
+ *  Key, special key and window size events are written one per line with the
+ *  frame and run time they arrived at, and an end event when the
+ *  recording is closed:
+ *     frame time key|special code
+ *     frame time reshape width height
+ *     frame time end
+ *  Replay reads the whole file and hands out each event at the first frame
+ *  whose run time has reached the recorded time, so a replay that
+ *  advances time in fixed steps repeats the same camera and modes on any machine.
+ */
+#include "water.h"
+
+static const char* Name[] = {"key","special","reshape","end"};
+
+/*
+ *  Create an input trace for writing
+ */
+struct inputTrace* InputCreate(const char* file)
+{
+   struct inputTrace* in = (struct inputTrace*)calloc(1,sizeof(struct inputTrace));
+   if (!in) Fatal("Cannot allocate input trace\n");
+   in->f = fopen(file,"w");
+   if (!in->f) Fatal("Cannot open input trace %s\n",file);
+   fprintf(in->f,"# Water surface input trace: frame time event code [height]\n");
+   return in;
+}
+
+/*
+ *  Append an event
+ */
+void InputWrite(struct inputTrace* in,int frame,double t,int type,int a,int b)
+{
+   fprintf(in->f,"%d %.6f %s",frame,t,Name[type]);
+   if (type==INPUT_RESHAPE)
+      fprintf(in->f," %d %d\n",a,b);
+   else if (type==INPUT_END)
+      fprintf(in->f,"\n");
+   else
+      fprintf(in->f," %d\n",a);
+}
+
+/*
+ *  Read an input trace for replay
+ */
+struct inputTrace* InputOpen(const char* file)
+{
+   char line[256],name[16];
+   int lineno=0;
+   struct inputTrace* in = (struct inputTrace*)calloc(1,sizeof(struct inputTrace));
+   FILE* f = fopen(file,"r");
+   if (!in) Fatal("Cannot allocate input trace\n");
+   if (!f) Fatal("Cannot open input trace %s\n",file);
+   while (fgets(line,sizeof(line),f))
+   {
+      struct inputEvent ev = {0,0,0,0,0};
+      int type;
+      lineno++;
+      if (line[0]=='#' || line[strspn(line," \t\r\n")]==0) continue;
+      if (sscanf(line,"%d %lf %15s %d %d",&ev.frame,&ev.t,name,&ev.a,&ev.b)<3)
+         Fatal("%s:%d: bad input event\n",file,lineno);
+      for (type=0;type<4 && strcmp(name,Name[type]);type++);
+      if (type==4) Fatal("%s:%d: unknown input event %s\n",file,lineno,name);
+      ev.type = type;
+      //  Grow event list
+      if (in->nev==in->nalloc)
+      {
+         in->nalloc = in->nalloc ? 2*in->nalloc : 256;
+         in->ev = (struct inputEvent*)realloc(in->ev,in->nalloc*sizeof(struct inputEvent));
+         if (!in->ev) Fatal("Cannot allocate %d input events\n",in->nalloc);
+      }
+      in->ev[in->nev++] = ev;
+   }
+   fclose(f);
+   if (!in->nev || in->ev[in->nev-1].type!=INPUT_END)
+      Fatal("%s has no end event (recording not closed?)\n",file);
+   return in;
+}
+
+/*
+ *  Next event due at time t
+ *     returns 0 when no event is due
+ */
+int InputNext(struct inputTrace* in,double t,struct inputEvent* ev)
+{
+   if (in->next>=in->nev || in->ev[in->next].t>t) return 0;
+   *ev = in->ev[in->next++];
+   return 1;
+}
+
+/*
+ *  Close an input trace
+ *     writers append the end event at frame and time t
+ */
+void InputClose(struct inputTrace* in,int frame,double t)
+{
+   if (!in) return;
+   if (in->f)
+   {
+      InputWrite(in,frame,t,INPUT_END,0,0);
+      fclose(in->f);
+   }
+   free(in->ev);
+   free(in);
+}
+
+/*
+ *  Frame time statistics
+ *     every frame is kept so the percentiles are exact, and written to a
+ *     CSV file when one is given so runs of different builds can be compared
+ */
+static const char* StatName[NSTAT] = {"simulate","draw","frame"};
+
+struct frameStats* StatsCreate(const char* csv)
+{
+   struct frameStats* s = (struct frameStats*)calloc(1,sizeof(struct frameStats));
+   if (!s) Fatal("Cannot allocate frame statistics\n");
+   if (csv)
+   {
+      int k;
+      s->f = fopen(csv,"w");
+      if (!s->f) Fatal("Cannot open statistics file %s\n",csv);
+      fprintf(s->f,"frame,time");
+      for (k=0;k<NSTAT;k++)
+         fprintf(s->f,",%s_ms",StatName[k]);
+      fprintf(s->f,"\n");
+   }
+   return s;
+}
+
+/*
+ *  Add the times in ms of one frame
+ */
+void StatsAdd(struct frameStats* s,int frame,double t,const double* ms)
+{
+   int k;
+   if (s->n==s->nalloc)
+   {
+      s->nalloc = s->nalloc ? 2*s->nalloc : 1024;
+      for (k=0;k<NSTAT;k++)
+      {
+         s->v[k] = (float*)realloc(s->v[k],s->nalloc*sizeof(float));
+         if (!s->v[k]) Fatal("Cannot allocate statistics for %d frames\n",s->nalloc);
+      }
+   }
+   for (k=0;k<NSTAT;k++)
+      s->v[k][s->n] = ms[k];
+   s->n++;
+   if (s->f)
+   {
+      fprintf(s->f,"%d,%.6f",frame,t);
+      for (k=0;k<NSTAT;k++)
+         fprintf(s->f,",%.4f",ms[k]);
+      fprintf(s->f,"\n");
+   }
+}
+
+static int CompareFloat(const void* a,const void* b)
+{
+   float x = *(const float*)a;
+   float y = *(const float*)b;
+   return (x>y) - (x<y);
+}
+
+/*
+ *  Print the mean and percentiles and free the statistics
+ */
+void StatsReport(struct frameStats* s)
+{
+   int k,i;
+   if (!s) return;
+   if (s->n)
+   {
+      fprintf(stderr,"Frame times over %d frames (ms)\n%-10s %9s %9s %9s %9s %9s\n",s->n,"","mean","median","95%","99%","max");
+      for (k=0;k<NSTAT;k++)
+      {
+         double sum=0;
+         float* v = s->v[k];
+         for (i=0;i<s->n;i++)
+            sum += v[i];
+         qsort(v,s->n,sizeof(float),CompareFloat);
+         fprintf(stderr,"%-10s %9.3f %9.3f %9.3f %9.3f %9.3f\n",StatName[k],sum/s->n,
+            v[s->n/2],v[(int)(0.95*(s->n-1))],v[(int)(0.99*(s->n-1))],v[s->n-1]);
+      }
+   }
+   if (s->f) fclose(s->f);
+   for (k=0;k<NSTAT;k++)
+      free(s->v[k]);
+   free(s);
+}
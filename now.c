@@ -0,0 +1,23 @@
+/*
+ *  Monotonic wall clock in ms
+ */
+#include "texLoad.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+double Now(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER f,c;
+   QueryPerformanceFrequency(&f);
+   QueryPerformanceCounter(&c);
+   return 1e3*c.QuadPart/f.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return 1e3*ts.tv_sec+1e-6*ts.tv_nsec;
+#endif
+}
@@ -1,10 +1,38 @@
 //  Per Pixel Lighting shader
+//  With Upsample set the reflection and specular intensity come from one
+//  bilinear fetch of the reduced resolution target written by reflect.frag,
+//  except where the texels under the pixel are not all water at nearly the
+//  same depth, which are shaded at full resolution (texels with no water
+//  have depth 0, so they also show up as a large depth variance)
 
 varying vec3 View;
 varying vec3 Light;
 varying vec3 Normal;
 
 uniform samplerCube skyBox;
+uniform bool Upsample;
+uniform sampler2D LowColor;   //  Reflection (rgb) and specular intensity (a)
+uniform sampler2D LowGeom;    //  Depth (r) and depth squared (g)
+uniform vec2 LowSize;         //  Size of the reduced resolution target
+uniform vec2 LowScale;        //  Reduced over full resolution
+uniform vec2 LowOrigin;       //  Window position of the viewport
+uniform bool CountFallback;   //  Discard the pixels taken from the reduced target
+
+//  Largest depth deviation over the footprint relative to the depth
+const float DepthTol = 0.05;
+
+//  Reflection color and specular intensity at full resolution
+void Shade(vec3 N,vec3 L,out vec3 refl,out float Is)
+{
+   //  V is the view vector (eye vector)
+   vec3 V = normalize(View);
+   //  R is the reflected light vector R = 2(L.N)N - L
+   vec3 R = reflect(-L,N);
+   //  Specular is cosine of reflected and view vectors
+   Is = (dot(L,N)>0.0) ? pow(max(dot(R,V),0.0) , gl_FrontMaterial.shininess) : 0.0;
+   //  Refelct the view vector to sample the cube map texture
+   refl = textureCube(skyBox,reflect(-V,N)).rgb;
+}
 
 void main()
 {
@@ -12,18 +40,31 @@ void main()
    vec3 N = normalize(Normal);
    //  L is the light vector
    vec3 L = normalize(Light);
-   //  R is the reflected light vector R = 2(L.N)N - L
-   vec3 R = reflect(-L,N);
-   //  V is the view vector (eye vector)
-   vec3 V = normalize(View);
-
-   //  Refelct the view vector to sample the cube map texture
-   vec3 reflectedview = reflect(-V,N);
 
    //  Diffuse light is cosine of light and normal vectors
    float Id = max(dot(L,N) , 0.0);
-   //  Specular is cosine of reflected and view vectors
-   float Is = (Id>0.0) ? pow(max(dot(R,V),0.0) , gl_FrontMaterial.shininess) : 0.0;
+
+   vec3  refl;
+   float Is;
+   if (Upsample)
+   {
+      //  Depth moments averaged over the bilinear footprint
+      vec2 uv = (gl_FragCoord.xy-LowOrigin)*LowScale/LowSize;
+      vec2 g = texture2D(LowGeom,uv).rg;
+      //  Depth variance small: bilinear reflection and specular
+      if (g.y-g.x*g.x<DepthTol*DepthTol*g.x*g.x)
+      {
+         if (CountFallback) discard;
+         vec4 low = texture2D(LowColor,uv);
+         refl = low.rgb;
+         Is   = low.a;
+      }
+      //  Depth or water edge: shade at full resolution
+      else
+         Shade(N,L,refl,Is);
+   }
+   else
+      Shade(N,L,refl,Is);
 
    //  Sum color types
    vec4 color   = gl_FrontMaterial.emission
@@ -32,5 +73,5 @@ void main()
                 + Is*gl_FrontLightProduct[0].specular;
 
    //  Apply texture
-   gl_FragColor = color * textureCube(skyBox,reflectedview);
+   gl_FragColor = color * vec4(refl,1.0);
 }
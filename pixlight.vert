@@ -1,21 +1,41 @@
 //  Per Pixel Lighting shader
+//  Water vertices arrive in a compact quantized format
+//     Grid   - grid index of the vertex (static buffer)
+//     Offset - Gerstner displacement (x,y) and height (z) as normalized shorts
+//     Oct    - octahedral encoded unit normal as normalized shorts
+
+attribute vec2 Grid;
+attribute vec3 Offset;
+attribute vec2 Oct;
+
+uniform vec2 GridXform;   //  Grid origin and spacing in world units
+uniform vec3 Range;       //  Scale of the displacement and height
 
 varying vec3 View;
 varying vec3 Light;
 varying vec3 Normal;
 
+//  Undo the octahedral fold of the lower hemisphere
+vec3 OctDecode(vec2 e)
+{
+   vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));
+   if (n.z<0.0)
+      n.xy = (1.0-abs(n.yx)) * (2.0*step(0.0,n.xy)-1.0);
+   return normalize(n);
+}
+
 void main()
 {
+   //  Reconstruct the surface vertex
+   vec4 Vertex = vec4(GridXform.x+GridXform.y*Grid + Range.xy*Offset.xy , Range.z*Offset.z , 1.0);
    //  Vertex location in modelview coordinates
-   vec4 P = gl_ModelViewMatrix * gl_Vertex;
+   vec4 P = gl_ModelViewMatrix * Vertex;
    //  Light position
    Light  = gl_LightSource[0].position.xyz - P.xyz;
    //  Normal
-   Normal = gl_NormalMatrix * gl_Normal;
+   Normal = gl_NormalMatrix * OctDecode(Oct);
    //  Eye position
    View  = -P.xyz;
-   //  Texture
-   gl_TexCoord[0] = gl_MultiTexCoord0;
    //  Set vertex position
-   gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+   gl_Position = gl_ModelViewProjectionMatrix * Vertex;
 }
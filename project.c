@@ -1,4 +1,12 @@
-#include "texLoad.h"
+#include "water.h"
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __GNUC__
+#define KERNEL static inline __attribute__((always_inline))
+#else
+#define KERNEL static inline
+#endif
 
 /* wave structure with appropriate parameters for Gerstner Waves */
 struct wave {
@@ -11,6 +19,21 @@ struct wave {
 	double p_const;	//	phase constant used in Gerstner Wave calculations
 };
 
+/* compact water vertex streamed to the GPU every frame (12 bytes) */
+/* the horizontal grid position is implicit and lives in a static buffer */
+struct packedVertex {
+	short dx,dy;	//  horizontal Gerstner displacement, snorm16 scaled by drange
+	short z;		//  height, snorm16 scaled by hrange
+	short pad;		//  keeps the normal 4 byte aligned
+	short nu,nv;	//  octahedral encoded unit normal, snorm16
+};
+
+/* simulation time and parameters a tile of the surface was computed for */
+struct tileStamp {
+	double t;		//  simulation time
+	int gen;		//  parameter generation (-1 never computed)
+};
+
 /* Globals */
 int mode=1;       //  Projection mode
 int mesh=0;		  //  Display water as a quad mesh
@@ -33,14 +56,20 @@ double lz=100.0;
 const char *daysides[6] = {"textures/sky_right.bmp","textures/sky_left.bmp","textures/sky_top.bmp","textures/sky_bottom.bmp","textures/sky_back.bmp","textures/sky_front.bmp"};
 const char *nightsides[6] = {"textures/nightsky_right.bmp","textures/nightsky_left.bmp","textures/nightsky_top.bmp","textures/nightsky_bot.bmp","textures/nightsky_back.bmp","textures/nightsky_front.bmp"};
 unsigned int texture[7];  //  Texture names
-unsigned int shader[2];	  //  Shaders
+unsigned int shader[3];	  //  Shaders
 
 int th=0;
 int ph=0;
 double asp=1.0;					// aspect ratio for viewport
 double q=.1;					// steepness factor for waves
 double g=9.8;					// gravity 9.8 m/s^2
-struct wave waves[8];			// array of wave structs used in animation
+struct wave* waves=NULL;		// array of wave structs used in animation
+#define MAXWAVES 256			// most waves in a set (the kernels keep per wave terms on the stack)
+int nwaves=0;					// number of waves in the set
+char* wavefile="waves.cfg";		// wave set file, reloaded when it changes
+time_t wavetime=0;				// modification time of the wave file when it was last read
+off_t wavesize=-1;				// size of the wave file when it was last read
+int sctier=SINCOS_MED;			// accuracy tier of the sine and cosine in the kernels
 double xmap[200][200];				// array to hold adjusted x coordinates for gerstner waves
 double ymap[200][200];				// array to hold adjusted y coordinates for gerstner waves
 double zmap[200][200];				// array to hold height mapping for x,y gerstner wave coordinates
@@ -48,7 +77,78 @@ double xnorm[200][200];				// array to hold x compponent of normal vectors
 double ynorm[200][200];				// array to hold y compponent of normal vectors
 double znorm[200][200];				// array to hold z compponent of normal vectors
 double qstep=2;					//	units between subsequently drawn quads on mesh
-double t=0;						// elapsed time in seconds
+double t=0;						// simulation time in seconds
+double wall=0;					// run time in seconds (fixed steps in an input replay)
+int paused=0;					// simulation time stopped
+double timescale=1;				// simulation seconds per run time second
+int paramgen=0;					// changes whenever the waves or the sincos tier change
+#define TILE 10					// grid points per side of a surface tile
+int ntile=0;					// tiles per side of the surface
+struct tileStamp* tiles=NULL;	// what each tile was last computed for
+int tilesdone=0,tilescurrent=0,tilesculled=0;	// tiles computed, already current and out of view last frame
+int evalframes=0,skipframes=0;	// frames that evaluated the surface and that skipped it
+int playframe=-1;				// replayed stream frame in the surface buffer
+#define NORM_ANALYTIC 0			// normals summed over all waves
+#define NORM_DIFF     1			// normals from central differences of the displaced positions
+#define NORM_DOMINANT 2			// normals of the dominant waves plus a separable detail map of the rest
+#define NORM_MODES    3
+#define SLOPE (180/PI)			// slope scale of the analytic normals (see diffNorms)
+const char* normname[NORM_MODES] = {"analytic","differences","dominant+detail"};
+int normmode=NORM_ANALYTIC;		// normal generation strategy
+
+int gridn=0;					// grid points per side of the water surface
+unsigned int surfbuf[4];		// surface buffers: grid index, packed vertices, strip indices, line indices
+int nstrip=0,nline=0;			// number of indices in the strip and line index buffers
+int gridloc[3],rangeloc[3];		// locations of the decode uniforms in pixlight.vert for each shader
+struct packedVertex* packed=NULL;	// staging array for the packed surface vertices
+double drange=1,hrange=1;		// quantization ranges for displacement and height
+int quantcheck=1;				// check the quantization error on the next upload
+#define STRIPBLOCK 14			// cells per strip block, sized for a 16 entry vertex cache
+#define BALLD 5					// degrees between light ball vertices
+#define BALLBANDS (180/BALLD)	// latitude bands of the light ball
+unsigned int ballbuf=0;			// light ball vertex buffer
+int ballfirst[BALLBANDS];		// first vertex of each latitude band
+int ballcount[BALLBANDS];		// vertices in each latitude band
+unsigned int skybuf=0;			// sky box vertex buffer
+int stissued=0,stskipped=0;		// state calls issued and skipped by the state filter last frame
+
+int winw=500,winh=500;			// window size
+int lowres=0;					// shade reflections and specular at reduced resolution
+double lowscale=0.5;			// scale of the reduced resolution target
+unsigned int lowfbo=0;			// reduced resolution target
+unsigned int lowtex[2];			// reflection and specular, normal and depth
+unsigned int lowdepth=0;		// depth buffer of the reduced resolution target
+int loww=0,lowh=0;				// size of the reduced resolution target
+int uploc,lowsizeloc,lowscaleloc,loworgloc,countloc;	// upsampling uniforms in pixlight.frag
+unsigned int squery;			// samples query counting the water pixels in compareLowres()
+int countwater=0;				// count water pixels: 1 all, 2 only those shaded at full resolution
+unsigned int watersamples=0;	// pixels counted
+int imgdiff=0;					// compare full and reduced resolution reflections on the next frame
+#define MAXVIEW 6				// most viewports in multi-view mode
+unsigned int wquery[MAXVIEW];	// GPU timer query around the water of each view
+int querypending=0;				// views whose timer query result is not read yet
+int queryview=-1;				// view whose water is being timed
+double watertime=0;				// GPU time of the water in all views in ms
+int waterviews=0;				// views timed in watertime
+int nviews=1;					// viewports drawn from each simulation step
+int vpx=0,vpy=0,vpw=500,vph=500;	// viewport being drawn
+double simtime=0,drawtime=0;	// CPU time of the simulation and of drawing the views in ms
+//  Monitor cameras of views 2 and up: azimuth from the main camera and elevation
+const int monitor[MAXVIEW-2][2] = {{90,20},{180,20},{270,20},{0,85}};
+struct frameStream* rec=NULL;	// surface stream being recorded
+struct frameStream* play=NULL;	// surface stream replayed instead of the simulation
+int capture=0;					// capture the frames drawn
+char* capfile="capture.y4m";	// Y4M stream or PPM file name pattern to capture to
+struct frameCapture* cap=NULL;	// capture in progress
+struct inputTrace* inrec=NULL;	// input events being recorded
+struct inputTrace* inplay=NULL;	// input events replayed instead of the user's
+double step=1.0/60;				// run time step of each frame of an input replay
+int injected=0;					// the event comes from the input replay
+int replayw=0,replayh=0;		// last window size of the input replay
+int replayframe=-1;				// frame the replay resized the window at, until it is checked
+int nframe=0;					// frames displayed
+struct frameStats* stats=NULL;	// frame time statistics
+double lastframe=0;				// wall clock at the end of the last frame in ms
 
 
 int lzh       =  15;  // Light azimuth
@@ -83,10 +183,11 @@ static void Project()
 }
 
 /* Utility function for adding a wave to our wave array */
+/* steepness is shared between the nwaves waves of the set */
 struct wave addWave(double d, double l, double a) {
 	double w = sqrt(g*2*PI/l);							//	set frequency of wave dispersion relation for water, ignoring higher-order terms
 														//  see https://developer.download.nvidia.com/books/HTML/gpugems/gpugems_ch01.html for additional info
-	double qi = q/(w * a * 8);
+	double qi = q/(w * a * nwaves);
 	double s = l*w;  									//  set speed of the wave according to speed = wavelength * frequency
 	double p_const = s*w;								//	set phase constant of the wave
 	double dx = Cos(d);									//	x component of wave direction
@@ -95,24 +196,36 @@ struct wave addWave(double d, double l, double a) {
 	return newWave;
 } 
 
-static void computeHeights() {
-	double dot_term,q_term;
+/*
+ *  Surface kernels
+ *     nw is a compile time constant at the specialized call sites below, so the
+ *     wave loop is unrolled with no loop overhead; other wave counts use the
+ *     same kernel with the count known only at run time
+ *     the phases of all waves at a vertex go through SinCosDeg() together, which is
+ *     inline so its loop over the waves has the same known count
+ */
+KERNEL void heightKernel(const int nw,int x0,int x1,int y0,int y1) {
+	const int tier=sctier;
+	double dot_term[nw],sn[nw],cs[nw];
+	double q_term;
 	double rX=0;
 	double rY=0;
 	double rZ=0;
 	double x,y;
 	int i,xindex,yindex;
-	for (x=-dim;x<dim;x+=qstep) {
-		for (y=-dim;y<dim;y+=qstep) {
-			for (i=0;i<8;i++) {
-				dot_term = waves[i].w*waves[i].dx*x + waves[i].w*waves[i].dy*y + waves[i].p_const*t;
+	for (xindex=x0;xindex<x1;xindex++) {
+		x = -dim+qstep*xindex;
+		for (yindex=y0;yindex<y1;yindex++) {
+			y = -dim+qstep*yindex;
+			for (i=0;i<nw;i++)
+				dot_term[i] = waves[i].w*waves[i].dx*x + waves[i].w*waves[i].dy*y + waves[i].p_const*t;
+			SinCosDeg(nw,dot_term,sn,cs,tier);
+			for (i=0;i<nw;i++) {
 				q_term = waves[i].qi*waves[i].a;
-				rX += q_term * waves[i].dx * Cos(dot_term);
-				rY += q_term * waves[i].dy * Cos(dot_term);
-				rZ += waves[i].a * Sin(dot_term);
+				rX += q_term * waves[i].dx * cs[i];
+				rY += q_term * waves[i].dy * cs[i];
+				rZ += waves[i].a * sn[i];
 			}
-			xindex = (x+dim)/qstep;
-			yindex = (y+dim)/qstep;
 			xmap[xindex][yindex] = x+rX;
 			ymap[xindex][yindex] = y+rY;
 			zmap[xindex][yindex] = rZ;
@@ -121,23 +234,24 @@ static void computeHeights() {
 	}
 }
 
-void computeNorms() {
-	double dot_term,w_term;
+KERNEL void normKernel(const int nw,const struct wave* wv,int x0,int x1,int y0,int y1) {
+	const int tier=sctier;
+	double dot_term[nw],sn[nw],cs[nw];
+	double w_term;
 	double rX=0;
 	double rY=0;
 	double rZ=0;
-	double x,y;
 	int i,xindex,yindex;
-	for (x=-dim;x<dim;x+=qstep) {
-		for (y=-dim;y<dim;y+=qstep) {
-			xindex = (x+dim)/qstep;
-			yindex = (y+dim)/qstep;
-			for (i=0;i<8;i++) {
-				w_term = waves[i].w*waves[i].a;
-				dot_term = waves[i].w*(waves[i].dx*xmap[xindex][yindex] + waves[i].dy*ymap[xindex][yindex]) + waves[i].p_const*t;
-				rX += waves[i].dx * w_term * Cos(dot_term);
-				rY += waves[i].dy * w_term * Cos(dot_term);
-				rZ += waves[i].qi * w_term * Sin(dot_term);
+	for (xindex=x0;xindex<x1;xindex++) {
+		for (yindex=y0;yindex<y1;yindex++) {
+			for (i=0;i<nw;i++)
+				dot_term[i] = wv[i].w*(wv[i].dx*xmap[xindex][yindex] + wv[i].dy*ymap[xindex][yindex]) + wv[i].p_const*t;
+			SinCosDeg(nw,dot_term,sn,cs,tier);
+			for (i=0;i<nw;i++) {
+				w_term = wv[i].w*wv[i].a;
+				rX += wv[i].dx * w_term * cs[i];
+				rY += wv[i].dy * w_term * cs[i];
+				rZ += wv[i].qi * w_term * sn[i];
 			}
 			xnorm[xindex][yindex] = -rX;
 			ynorm[xindex][yindex]  = -rY;
@@ -147,17 +261,568 @@ void computeNorms() {
 	}
 }
 
+/* Dispatch to the kernel specialized for the wave count */
+/* the grid points x0<=x<x1, y0<=y<y1 are computed */
+static void computeHeights(int x0,int x1,int y0,int y1) {
+	switch (nwaves) {
+		case 4:  heightKernel(4,x0,x1,y0,y1);  break;
+		case 8:  heightKernel(8,x0,x1,y0,y1);  break;
+		case 16: heightKernel(16,x0,x1,y0,y1); break;
+		case 32: heightKernel(32,x0,x1,y0,y1); break;
+		default: heightKernel(nwaves,x0,x1,y0,y1);
+	}
+}
+
+/* the normals use the first nw waves of wv */
+void computeNorms(const struct wave* wv,int nw,int x0,int x1,int y0,int y1) {
+	switch (nw) {
+		case 4:  normKernel(4,wv,x0,x1,y0,y1);  break;
+		case 8:  normKernel(8,wv,x0,x1,y0,y1);  break;
+		case 16: normKernel(16,wv,x0,x1,y0,y1); break;
+		case 32: normKernel(32,wv,x0,x1,y0,y1); break;
+		default: normKernel(nw,wv,x0,x1,y0,y1);
+	}
+}
+
+/*
+ *  Normals from central differences of the displaced positions
+ *     (one sided on the edges of the grid), the heights of the neighbours must be current
+ *     the kernels take phases in degrees but the analytic normals use w per
+ *     radian, so they are the normals of the surface with its displacement
+ *     scaled by SLOPE; the differences are scaled the same way to shade alike
+ */
+static void diffNorms(int x0,int x1,int y0,int y1) {
+	int x,y;
+	for (x=x0;x<x1;x++) {
+		int xa = x>0 ? x-1 : x;
+		int xb = x<gridn-1 ? x+1 : x;
+		for (y=y0;y<y1;y++) {
+			int ya = y>0 ? y-1 : y;
+			int yb = y<gridn-1 ? y+1 : y;
+			//  Tangents along the grid directions
+			double hx = qstep*(xb-xa);
+			double hy = qstep*(yb-ya);
+			double ux = hx+SLOPE*(xmap[xb][y]-xmap[xa][y]-hx);
+			double uy = SLOPE*(ymap[xb][y]-ymap[xa][y]);
+			double uz = SLOPE*(zmap[xb][y]-zmap[xa][y]);
+			double vx = SLOPE*(xmap[x][yb]-xmap[x][ya]);
+			double vy = hy+SLOPE*(ymap[x][yb]-ymap[x][ya]-hy);
+			double vz = SLOPE*(zmap[x][yb]-zmap[x][ya]);
+			//  Normal is their cross product (not normalized, like the analytic normal)
+			xnorm[x][y] = uy*vz-uz*vy;
+			ynorm[x][y] = uz*vx-ux*vz;
+			znorm[x][y] = ux*vy-uy*vx;
+		}
+	}
+}
+
 /*
- *  Draw vertex in polar coordinates
+ *  Add the normal terms of nw detail waves from a separable detail map
+ *     at the undisplaced grid point the phase of a wave is a row term plus a
+ *     column term, so sin and cos of the rows and columns give the phase at
+ *     every point by the angle sum formulas, without a sincos per point
+ */
+static void detailNorms(const struct wave* wv,int nw,int x0,int x1,int y0,int y1) {
+	int nx=x1-x0,ny=y1-y0;
+	double rp[nx],rs[nx],rc[nx],cp[ny],cs[ny],cc[ny];
+	int i,j,k;
+	for (k=0;k<nw;k++) {
+		double w_term = wv[k].w*wv[k].a;
+		double ax = -wv[k].dx*w_term;
+		double ay = -wv[k].dy*w_term;
+		double az = -wv[k].qi*w_term;
+		//  Row and column phases
+		for (i=0;i<nx;i++)
+			rp[i] = wv[k].w*wv[k].dx*(-dim+qstep*(x0+i));
+		for (j=0;j<ny;j++)
+			cp[j] = wv[k].w*wv[k].dy*(-dim+qstep*(y0+j)) + wv[k].p_const*t;
+		SinCosDeg(nx,rp,rs,rc,sctier);
+		SinCosDeg(ny,cp,cs,cc,sctier);
+		for (i=0;i<nx;i++) {
+			for (j=0;j<ny;j++) {
+				double c = rc[i]*cc[j] - rs[i]*cs[j];
+				double s = rs[i]*cc[j] + rc[i]*cs[j];
+				xnorm[x0+i][y0+j] += ax*c;
+				ynorm[x0+i][y0+j] += ay*c;
+				znorm[x0+i][y0+j] += az*s;
+			}
+		}
+	}
+}
+
+/* Order waves by the slope they add to the normal (w*a), largest first */
+static int compareSlope(const void* a,const void* b) {
+	double sa = ((const struct wave*)a)->w*((const struct wave*)a)->a;
+	double sb = ((const struct wave*)b)->w*((const struct wave*)b)->a;
+	return (sa<sb) - (sa>sb);
+}
+
+/*
+ *  Normals of the grid points x0<=x<x1, y0<=y<y1 with the selected strategy
+ *     their heights must be current (for differences also the neighbours' heights)
+ */
+static void surfaceNorms(int x0,int x1,int y0,int y1) {
+	static struct wave* sorted=NULL;
+	static int sortedgen=-1;
+	int nd;
+	if (normmode==NORM_ANALYTIC)
+		computeNorms(waves,nwaves,x0,x1,y0,y1);
+	else if (normmode==NORM_DIFF)
+		diffNorms(x0,x1,y0,y1);
+	else {
+		//  Waves by slope when they change
+		if (sortedgen!=paramgen) {
+			sorted = (struct wave*)realloc(sorted,nwaves*sizeof(struct wave));
+			if (!sorted) Fatal("Cannot allocate %d waves\n",nwaves);
+			memcpy(sorted,waves,nwaves*sizeof(struct wave));
+			qsort(sorted,nwaves,sizeof(struct wave),compareSlope);
+			sortedgen = paramgen;
+		}
+		//  Dominant half of the waves exactly and the rest from the detail map
+		nd = (nwaves+1)/2;
+		computeNorms(sorted,nd,x0,x1,y0,y1);
+		detailNorms(sorted+nd,nwaves-nd,x0,x1,y0,y1);
+	}
+}
+
+/*
+ *  Built in wave set used when there is no wave file
+ */
+static void defaultWaves() {
+	nwaves = 8;
+	waves = (struct wave*)realloc(waves,nwaves*sizeof(struct wave));
+	if (!waves) Fatal("Cannot allocate %d waves\n",nwaves);
+ 	waves[0] = addWave(232,.2,.3);
+	waves[1] = addWave(106,.1,.2);
+	waves[2] = addWave(16,.3,.1);
+	waves[3] = addWave(338,.1,.3);
+	waves[4] = addWave(56,.0005,.01);
+	waves[5] = addWave(176,.001,.02);
+	waves[6] = addWave(89,.002,.03);
+	waves[7] = addWave(202,.004,.04);
+}
+
+/*
+ *  Load a wave set
+ *     one wave per line as "direction wavelength amplitude" (degrees, m, m)
+ *     an optional "q steepness" line sets the steepness shared by the set
+ *     # starts a comment
+ *  Returns 0 and leaves the current wave set alone if the file cannot be used
+ */
+static int loadWaves(const char* file) {
+	char line[256];
+	double d[3];
+	double* param=NULL;
+	double qnew=q;
+	int k,n=0,lineno=0;
+	FILE* f = fopen(file,"r");
+	if (!f) return 0;
+	while (fgets(line,sizeof(line),f)) {
+		char* c = strchr(line,'#');
+		lineno++;
+		if (c) *c = 0;
+		if (sscanf(line," q %lf",&qnew)==1)
+			continue;
+		k = sscanf(line,"%lf %lf %lf",d,d+1,d+2);
+		if (k<=0)
+			continue;
+		if (k!=3 || d[1]<=0 || d[2]<=0) {
+			fprintf(stderr,"%s:%d: expected direction wavelength amplitude\n",file,lineno);
+			fclose(f);
+			free(param);
+			return 0;
+		}
+		if (n==MAXWAVES) {
+			fprintf(stderr,"%s:%d: more than %d waves\n",file,lineno,MAXWAVES);
+			fclose(f);
+			free(param);
+			return 0;
+		}
+		param = (double*)realloc(param,3*(n+1)*sizeof(double));
+		if (!param) Fatal("Cannot allocate %d waves\n",n+1);
+		memcpy(param+3*n++,d,sizeof(d));
+	}
+	fclose(f);
+	if (n==0) {
+		fprintf(stderr,"%s: no waves\n",file);
+		return 0;
+	}
+	//  Replace the wave set
+	q = qnew;
+	nwaves = n;
+	waves = (struct wave*)realloc(waves,nwaves*sizeof(struct wave));
+	if (!waves) Fatal("Cannot allocate %d waves\n",nwaves);
+	for (k=0;k<n;k++)
+		waves[k] = addWave(param[3*k],param[3*k+1],param[3*k+2]);
+	free(param);
+	fprintf(stderr,"Loaded %d waves from %s\n",nwaves,file);
+	return 1;
+}
+
+/*-------------------------------------------------------------------------------------------------------
+										Compact Surface Upload
+-------------------------------------------------------------------------------------------------------*/
+
+/*
+ *  Set the quantization ranges from the wave set
+ *     |displacement| <= sum(qi*a) and |height| <= sum(a)
+ */
+static void quantRanges() {
+	int i;
+	drange = hrange = 0;
+	for (i=0;i<nwaves;i++) {
+		drange += fabs(waves[i].qi*waves[i].a);
+		hrange += fabs(waves[i].a);
+	}
+	if (drange<=0) drange = 1;
+	if (hrange<=0) hrange = 1;
+}
+
+/* Clamp and round a value in [-1,1] to a signed normalized short */
+static short snorm16(double v) {
+	if (v>1) v = 1;
+	if (v<-1) v = -1;
+	return (short)floor(v*32767+0.5);
+}
+
+/*
+ *  Octahedral encoding of a normal into two snorm16 values
+ *     project onto the octahedron |x|+|y|+|z|=1 and fold the lower half over the diagonals
+ */
+static void octEncode(double nx,double ny,double nz,short* u,short* v) {
+	double len = fabs(nx)+fabs(ny)+fabs(nz);
+	double ox = len>0 ? nx/len : 0;
+	double oy = len>0 ? ny/len : 0;
+	if (nz<0) {
+		double tx = (1-fabs(oy))*(ox>=0 ? 1 : -1);
+		double ty = (1-fabs(ox))*(oy>=0 ? 1 : -1);
+		ox = tx;
+		oy = ty;
+	}
+	*u = snorm16(ox);
+	*v = snorm16(oy);
+}
+
+/* Inverse of octEncode, mirrors OctDecode() in pixlight.vert */
+static void octDecode(short u,short v,double n[3]) {
+	double len;
+	n[0] = u/32767.0;
+	n[1] = v/32767.0;
+	n[2] = 1-fabs(n[0])-fabs(n[1]);
+	if (n[2]<0) {
+		double tx = (1-fabs(n[1]))*(n[0]>=0 ? 1 : -1);
+		double ty = (1-fabs(n[0]))*(n[1]>=0 ? 1 : -1);
+		n[0] = tx;
+		n[1] = ty;
+	}
+	len = sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+	n[0] /= len;
+	n[1] /= len;
+	n[2] /= len;
+}
+
+/*
+ *  Surface topology
+ *     cells are split into blocks of block columns, and each block is drawn as
+ *     one triangle strip per row of cells, so the row of vertices shared by two
+ *     strips is still in the post-transform cache when the second strip uses it
+ *     strips are joined by repeating the last and next index (degenerate triangles)
+ *  Returns the number of indices (at most 6*gridn*gridn)
+ */
+static int surfaceStrips(unsigned int* idx,int block) {
+	int x,y,x0,x1,k=0;
+	for (x0=0;x0<gridn-1;x0=x1) {
+		x1 = x0+block<gridn-1 ? x0+block : gridn-1;
+		//  Bring the first row of the block into the cache with degenerate triangles,
+		//  otherwise the first strip loads two rows and a FIFO cache never recovers
+		if (k) {
+			idx[k] = idx[k-1];
+			k++;
+			idx[k++] = x0*gridn;
+		}
+		for (x=x0;x<=x1;x++) {
+			idx[k++] = x*gridn;
+			idx[k++] = x*gridn;
+		}
+		for (y=0;y<gridn-1;y++) {
+			//  Join to the previous strip
+			idx[k] = idx[k-1];
+			k++;
+			idx[k++] = x0*gridn+y;
+			for (x=x0;x<=x1;x++) {
+				idx[k++] = x*gridn+y;
+				idx[k++] = x*gridn+y+1;
+			}
+		}
+	}
+	return k;
+}
+
+/*
+ *  Line list of every edge of the strip triangles once, in the same block order
+ *     the column shared by two blocks is drawn by the block to its right
+ */
+static int surfaceLines(unsigned int* idx,int block) {
+	int x,y,x0,x1,k=0;
+	for (x0=0;x0<gridn-1;x0=x1) {
+		x1 = x0+block<gridn-1 ? x0+block : gridn-1;
+		for (y=0;y<gridn;y++) {
+			for (x=x0;x<=x1;x++) {
+				//  Edge along y
+				if (y<gridn-1 && (x<x1 || x1==gridn-1)) {
+					idx[k++] = x*gridn+y;
+					idx[k++] = x*gridn+y+1;
+				}
+				if (x<x1) {
+					//  Edge along x
+					idx[k++] = x*gridn+y;
+					idx[k++] = (x+1)*gridn+y;
+					//  Diagonal splitting the cell
+					if (y<gridn-1) {
+						idx[k++] = x*gridn+y+1;
+						idx[k++] = (x+1)*gridn+y;
+					}
+				}
+			}
+		}
+	}
+	return k;
+}
+
+/*
+ *  Average cache miss ratio (vertices transformed per triangle) of a triangle
+ *  strip on a FIFO post-transform cache of the given size
+ */
+static double stripACMR(const unsigned int* idx,int n,int size) {
+	unsigned int cache[64];
+	int i,j,head=0,used=0,miss=0,tri=0;
+	if (size>64) size = 64;
+	for (i=0;i<n;i++) {
+		for (j=0;j<used && cache[j]!=idx[i];j++);
+		if (j==used) {
+			miss++;
+			cache[head] = idx[i];
+			head = (head+1)%size;
+			if (used<size) used++;
+		}
+		if (i>=2 && idx[i]!=idx[i-1] && idx[i]!=idx[i-2] && idx[i-1]!=idx[i-2]) tri++;
+	}
+	return tri ? (double)miss/tri : 0;
+}
+
+/*
+ *  Create the surface buffers
+ *     the grid index buffer and both index buffers are static and uploaded once
+ */
+static void initSurface() {
+	int x,y,k;
+	short* grid;
+	unsigned int* idx;
+
+	for (k=1;k<3;k++) {
+		gridloc[k] = glGetUniformLocation(shader[k],"GridXform");
+		rangeloc[k] = glGetUniformLocation(shader[k],"Range");
+	}
+	gridn = (2*dim)/qstep;
+	if (gridn<2) Fatal("Surface grid of %d points is too small\n",gridn);
+	quantRanges();
+	packed = (struct packedVertex*)malloc(gridn*gridn*sizeof(struct packedVertex));
+	grid = (short*)malloc(2*gridn*gridn*sizeof(short));
+	idx = (unsigned int*)malloc(6*gridn*gridn*sizeof(unsigned int));
+	ntile = (gridn+TILE-1)/TILE;
+	tiles = (struct tileStamp*)malloc(ntile*ntile*sizeof(struct tileStamp));
+	if (!packed || !grid || !idx || !tiles) Fatal("Cannot allocate surface buffers for %dx%d grid\n",gridn,gridn);
+	for (k=0;k<ntile*ntile;k++)
+		tiles[k].gen = -1;
+	glGenBuffers(4,surfbuf);
+
+	//  Grid index of every vertex
+	for (x=0;x<gridn;x++) {
+		for (y=0;y<gridn;y++) {
+			grid[2*(x*gridn+y)+0] = x;
+			grid[2*(x*gridn+y)+1] = y;
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER,surfbuf[0]);
+	glBufferData(GL_ARRAY_BUFFER,2*gridn*gridn*sizeof(short),grid,GL_STATIC_DRAW);
+
+	//  Packed vertices are respecified every frame
+	glBindBuffer(GL_ARRAY_BUFFER,surfbuf[1]);
+	glBufferData(GL_ARRAY_BUFFER,gridn*gridn*sizeof(struct packedVertex),NULL,GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+
+	//  Triangle strips in column blocks
+	nstrip = surfaceStrips(idx,STRIPBLOCK);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,surfbuf[2]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,nstrip*sizeof(unsigned int),idx,GL_STATIC_DRAW);
+	fprintf(stderr,"Surface strips: ACMR %.3f (16 entry FIFO) %.3f (32 entry FIFO)",
+		stripACMR(idx,nstrip,16),stripACMR(idx,nstrip,32));
+	k = surfaceStrips(idx,gridn-1);
+	fprintf(stderr,", full width row strips %.3f %.3f\n",stripACMR(idx,k,16),stripACMR(idx,k,32));
+
+	//  Edges of the same triangles for the mesh
+	nline = surfaceLines(idx,STRIPBLOCK);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,surfbuf[3]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,nline*sizeof(unsigned int),idx,GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+
+	free(grid);
+	free(idx);
+	fprintf(stderr,"Surface upload: %d bytes/frame (immediate mode sent %d)\n",
+		(int)(gridn*gridn*sizeof(struct packedVertex)),
+		(int)(4*(gridn-1)*(gridn-1)*(3*sizeof(double)+3*sizeof(float))));
+}
+
+/* Is tile tx,ty computed for this time and these parameters? */
+static int tileCurrent(int tx,int ty) {
+	return tiles[tx*ntile+ty].t==t && tiles[tx*ntile+ty].gen==paramgen;
+}
+
+/*
+ *  Compare the packed surface against the double precision maps
+ *     (tiles that are not current are left out)
+ *     position error must stay within one quantization step per component
+ *     and the decoded normal within a tenth of a degree of the analytic normal
+ */
+static void checkQuantError() {
+	int x,y;
+	double perr=0,nerr=0;
+	double pbound = (drange>hrange ? drange : hrange)/32767;
+	double nbound = 0.1*PI/180;
+	for (x=0;x<gridn;x++) {
+		for (y=0;y<gridn;y++) {
+			//  Only tiles computed for this time and these parameters
+			if (!tileCurrent(x/TILE,y/TILE)) continue;
+			struct packedVertex* v = &packed[x*gridn+y];
+			double gx = -dim+qstep*x;
+			double gy = -dim+qstep*y;
+			double ex = fabs(gx+drange*v->dx/32767.0 - xmap[x][y]);
+			double ey = fabs(gy+drange*v->dy/32767.0 - ymap[x][y]);
+			double ez = fabs(hrange*v->z/32767.0 - zmap[x][y]);
+			double len = sqrt(xnorm[x][y]*xnorm[x][y]+ynorm[x][y]*ynorm[x][y]+znorm[x][y]*znorm[x][y]);
+			double n[3],c;
+			octDecode(v->nu,v->nv,n);
+			c = (n[0]*xnorm[x][y]+n[1]*ynorm[x][y]+n[2]*znorm[x][y])/len;
+			if (c>1) c = 1;
+			if (ex>perr) perr = ex;
+			if (ey>perr) perr = ey;
+			if (ez>perr) perr = ez;
+			if (acos(c)>nerr) nerr = acos(c);
+		}
+	}
+	fprintf(stderr,"Quantization error: position %.3g (bound %.3g) normal %.3g deg (bound %.3g)%s\n",
+		perr,pbound,nerr*180/PI,nbound*180/PI,(perr>pbound || nerr>nbound) ? " EXCEEDS BOUND" : "");
+}
+
+/*
+ *  Pack the grid points x0<=x<x1, y0<=y<y1 of the surface maps
+ */
+static void packSurface(int x0,int x1,int y0,int y1) {
+	int x,y;
+	for (x=x0;x<x1;x++) {
+		for (y=y0;y<y1;y++) {
+			struct packedVertex* v = &packed[x*gridn+y];
+			v->dx = snorm16((xmap[x][y]-(-dim+qstep*x))/drange);
+			v->dy = snorm16((ymap[x][y]-(-dim+qstep*y))/drange);
+			v->z  = snorm16(zmap[x][y]/hrange);
+			v->pad = 0;
+			octEncode(xnorm[x][y],ynorm[x][y],znorm[x][y],&v->nu,&v->nv);
+		}
+	}
+}
+
+/*
+ *  Stream the packed surface to the GPU
+ */
+static void uploadSurface() {
+	//  Orphan the previous frame's storage so the upload does not wait on the draw
+	glBindBuffer(GL_ARRAY_BUFFER,surfbuf[1]);
+	glBufferData(GL_ARRAY_BUFFER,gridn*gridn*sizeof(struct packedVertex),NULL,GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER,0,gridn*gridn*sizeof(struct packedVertex),packed);
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
+/*
+ *  Draw the packed surface with shader[prog], which must be current
+ */
+static void drawSurface(int prog) {
+	//  Decode parameters for pixlight.vert
+	glUniform2f(gridloc[prog],-dim,qstep);
+	glUniform3f(rangeloc[prog],drange,drange,hrange);
+
+	//  Grid index (attribute 0)
+	glBindBuffer(GL_ARRAY_BUFFER,surfbuf[0]);
+	glVertexAttribPointer(0,2,GL_SHORT,GL_FALSE,0,(void*)0);
+	glEnableVertexAttribArray(0);
+	//  Displacement and height (attribute 1) and octahedral normal (attribute 2)
+	glBindBuffer(GL_ARRAY_BUFFER,surfbuf[1]);
+	glVertexAttribPointer(1,3,GL_SHORT,GL_TRUE,sizeof(struct packedVertex),(void*)0);
+	glVertexAttribPointer(2,2,GL_SHORT,GL_TRUE,sizeof(struct packedVertex),(void*)(4*sizeof(short)));
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+
+	if (mesh) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,surfbuf[3]);
+		glDrawElements(GL_LINES,nline,GL_UNSIGNED_INT,(void*)0);
+	}
+	else {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,surfbuf[2]);
+		glDrawElements(GL_TRIANGLE_STRIP,nstrip,GL_UNSIGNED_INT,(void*)0);
+	}
+
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(2);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
+/*-------------------------------------------------------------------------------------------------------
+									End of Compact Surface Upload
+-------------------------------------------------------------------------------------------------------*/
+
+/*
+ *  Vertex in polar coordinates, stored as normal and position
+ */
+/* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 8 */
+static float* Vertex(double th,double ph,float* v)
+{
+   v[0] = v[3] = Sin(th)*Cos(ph);
+   v[1] = v[4] = Cos(th)*Cos(ph);
+   v[2] = v[5] =         Sin(ph);
+   return v+6;
+}
+
+/*
+ *  Build the unit sphere once as latitude band quad strips
  */
 /* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 8 */
-static void Vertex(double th,double ph)
+static void initSphere()
 {
-   double x = Sin(th)*Cos(ph);
-   double y = Cos(th)*Cos(ph);
-   double z =         Sin(ph);
-   glNormal3d(x,y,z);
-   glVertex3d(x,y,z);
+   const int d=BALLD;
+   int th,ph,k=0;
+   float* v = (float*)malloc(BALLBANDS*2*(360/d+1)*6*sizeof(float));
+   float* p = v;
+   if (!v) Fatal("Cannot allocate sphere vertices\n");
+
+   //  Latitude bands
+   for (ph=-90;ph<90;ph+=d)
+   {
+      ballfirst[k] = (p-v)/6;
+      for (th=0;th<=360;th+=d)
+      {
+         p = Vertex(th,ph,p);
+         p = Vertex(th,ph+d,p);
+      }
+      ballcount[k] = (p-v)/6-ballfirst[k];
+      k++;
+   }
+
+   glGenBuffers(1,&ballbuf);
+   glBindBuffer(GL_ARRAY_BUFFER,ballbuf);
+   glBufferData(GL_ARRAY_BUFFER,(p-v)*sizeof(float),v,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   free(v);
 }
 
 /*
@@ -168,78 +833,87 @@ static void Vertex(double th,double ph)
 /* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 8 */
 static void sphere(double x,double y,double z,double r)
 {
-   const int d=5;
-   int th,ph;
-
    //  Save transformation
    glPushMatrix();
    //  Offset and scale
    glTranslated(x,y,z);
    glScaled(r,r,r);
 
-   //  Latitude bands
-   for (ph=-90;ph<90;ph+=d)
-   {
-      glBegin(GL_QUAD_STRIP);
-      for (th=0;th<=360;th+=d)
-      {
-         Vertex(th,ph);
-         Vertex(th,ph+d);
-      }
-      glEnd();
-   }
+   //  All latitude bands in one call
+   glBindBuffer(GL_ARRAY_BUFFER,ballbuf);
+   glInterleavedArrays(GL_N3F_V3F,0,(void*)0);
+   glMultiDrawArrays(GL_QUAD_STRIP,ballfirst,ballcount,BALLBANDS);
+   glDisableClientState(GL_VERTEX_ARRAY);
+   glDisableClientState(GL_NORMAL_ARRAY);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
 
    //  Undo transformations
    glPopMatrix();
 }
 
+/* 
+ *  Build the sky box once
+ */
+static void initSky(float D)
+{
+   //  Texture coordinates and vertices of the sides, top and bottom
+   const float v[] = {
+   0.00,1.0/3.0, -D,-D,-D,
+   0.25,1.0/3.0, +D,-D,-D,
+   0.25,2.0/3.0, +D,+D,-D,
+   0.00,2.0/3.0, -D,+D,-D,
+
+   0.25,1.0/3.0, +D,-D,-D,
+   0.50,1.0/3.0, +D,-D,+D,
+   0.50,2.0/3.0, +D,+D,+D,
+   0.25,2.0/3.0, +D,+D,-D,
+
+   0.50,1.0/3.0, +D,-D,+D,
+   0.75,1.0/3.0, -D,-D,+D,
+   0.75,2.0/3.0, -D,+D,+D,
+   0.50,2.0/3.0, +D,+D,+D,
+
+   0.75,1.0/3.0, -D,-D,+D,
+   1.00,1.0/3.0, -D,-D,-D,
+   1.00,2.0/3.0, -D,+D,-D,
+   0.75,2.0/3.0, -D,+D,+D,
+
+   0.25,2.0/3.0, +D,+D,-D,
+   0.5,2.0/3.0,  +D,+D,+D,
+   0.5,1,        -D,+D,+D,
+   0.25,1,       -D,+D,-D,
+
+   0.5,0,        -D,-D,+D,
+   0.5,1.0/3.0,  +D,-D,+D,
+   0.25,1.0/3.0, +D,-D,-D,
+   0.25,0,       -D,-D,-D,
+   };
+
+   glGenBuffers(1,&skybuf);
+   glBindBuffer(GL_ARRAY_BUFFER,skybuf);
+   glBufferData(GL_ARRAY_BUFFER,sizeof(v),v,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
 /* 
  *  Draw sky box
  */
-static void Sky(double D)
+static void Sky()
 {
    glColor3f(1,1,1);
-   glEnable(GL_TEXTURE_2D);
+   StEnable(GL_TEXTURE_2D,1);
 
    //  Sides
-   glBindTexture(GL_TEXTURE_2D,day ? texture[0] : texture[2]);
-
-   glBegin(GL_QUADS);
-   glTexCoord2f(0.00,1.0/3.0); glVertex3f(-D,-D,-D);
-   glTexCoord2f(0.25,1.0/3.0); glVertex3f(+D,-D,-D);
-   glTexCoord2f(0.25,2.0/3.0); glVertex3f(+D,+D,-D);
-   glTexCoord2f(0.00,2.0/3.0); glVertex3f(-D,+D,-D);
-
-   glTexCoord2f(0.25,1.0/3.0); glVertex3f(+D,-D,-D);
-   glTexCoord2f(0.50,1.0/3.0); glVertex3f(+D,-D,+D);
-   glTexCoord2f(0.50,2.0/3.0); glVertex3f(+D,+D,+D);
-   glTexCoord2f(0.25,2.0/3.0); glVertex3f(+D,+D,-D);
-
-   glTexCoord2f(0.50,1.0/3.0); glVertex3f(+D,-D,+D);
-   glTexCoord2f(0.75,1.0/3.0); glVertex3f(-D,-D,+D);
-   glTexCoord2f(0.75,2.0/3.0); glVertex3f(-D,+D,+D);
-   glTexCoord2f(0.50,2.0/3.0); glVertex3f(+D,+D,+D);
+   StBindTexture(GL_TEXTURE_2D,day ? texture[0] : texture[2]);
 
-   glTexCoord2f(0.75,1.0/3.0); glVertex3f(-D,-D,+D);
-   glTexCoord2f(1.00,1.0/3.0); glVertex3f(-D,-D,-D);
-   glTexCoord2f(1.00,2.0/3.0); glVertex3f(-D,+D,-D);
-   glTexCoord2f(0.75,2.0/3.0); glVertex3f(-D,+D,+D); 
+   glBindBuffer(GL_ARRAY_BUFFER,skybuf);
+   glInterleavedArrays(GL_T2F_V3F,0,(void*)0);
+   glDrawArrays(GL_QUADS,0,24);
+   glDisableClientState(GL_VERTEX_ARRAY);
+   glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
 
-   //  Top and bottom
-   glTexCoord2f(0.25,2.0/3.0); glVertex3f(+D,+D,-D);
-   glTexCoord2f(0.5,2.0/3.0); glVertex3f(+D,+D,+D);
-   glTexCoord2f(0.5,1); glVertex3f(-D,+D,+D);
-   glTexCoord2f(0.25,1); glVertex3f(-D,+D,-D);
-
-   glTexCoord2f(0.5,0); glVertex3f(-D,-D,+D);
-   glTexCoord2f(0.5,1.0/3.0); glVertex3f(+D,-D,+D);
-   glTexCoord2f(0.25,1.0/3.0); glVertex3f(+D,-D,-D);
-   glTexCoord2f(0.25,0); glVertex3f(-D,-D,-D);
-
-
-   glEnd(); 
-
-   glDisable(GL_TEXTURE_2D);
+   StEnable(GL_TEXTURE_2D,0);
 }
 
 /*-------------------------------------------------------------------------------------------------------
@@ -332,9 +1006,12 @@ int CreateShader(GLenum type,char* file)
 
 /*
  *  Create Shader Program
+ *     Name[] is a NULL terminated list of attributes bound to locations 0,1,2,...
+ *     before linking (NULL for no bindings)
  */
-int CreateShaderProg(char* VertFile,char* FragFile)
+int CreateShaderProg(char* VertFile,char* FragFile,char* Name[])
 {
+   int k;
    //  Create program
    int prog = glCreateProgram();
    //  Create and compile vertex shader
@@ -345,6 +1022,9 @@ int CreateShaderProg(char* VertFile,char* FragFile)
    glAttachShader(prog,vert);
    //  Attach fragment shader
    glAttachShader(prog,frag);
+   //  Set attribute locations
+   for (k=0;Name && Name[k];k++)
+      glBindAttribLocation(prog,k,Name[k]);
    //  Link program
    glLinkProgram(prog);
    //  Check for errors
@@ -369,14 +1049,58 @@ void reshape(int width,int height)
    asp = (height>0) ? (double)width/height : 1;
    //  Set the viewport to the entire window
    glViewport(0,0, width,height);
+   winw = width;
+   winh = height;
+   if (inrec) InputWrite(inrec,nframe,wall,INPUT_RESHAPE,width,height);
+   //  Resized by the user during an input replay
+   if (inplay && replayw && replayframe<0 && (width!=replayw || height!=replayh))
+      fprintf(stderr,"Input replay: window resized to %dx%d at frame %d, recorded %dx%d\n",width,height,nframe,replayw,replayh);
 
 }
 
+/*
+ *  Reload the wave file when it changes
+ *     polled twice a second from idle()
+ *     the size is compared too, so a file caught half written is read again
+ *     when the write finishes within the same second of modification time
+ */
+static void checkWaves() {
+	static double last=0;
+	struct stat st;
+	if (wall-last<0.5) return;
+	last = wall;
+	if (stat(wavefile,&st) || (st.st_mtime==wavetime && st.st_size==wavesize)) return;
+	wavetime = st.st_mtime;
+	wavesize = st.st_size;
+	//  Quantization ranges of a stream are fixed in its header
+	if (rec || play) {
+		fprintf(stderr,"%s changed, not reloaded while recording or replaying\n",wavefile);
+		return;
+	}
+	if (loadWaves(wavefile)) {
+		quantRanges();
+		quantcheck = 1;
+		paramgen++;
+	}
+}
+
+/*
+ *  Advance the simulation time to run time now
+ */
+static void advanceTime(double now) {
+	if (!paused) t += timescale*(now-wall);
+	wall = now;
+}
+
 /* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 1-5 */
 void idle()
 {
-   //  Get elapsed (wall) time in seconds
-   t = glutGet(GLUT_ELAPSED_TIME)/1000.0;
+   //  Get elapsed (wall) time in seconds (an input replay steps time in display())
+   if (!inplay)
+      advanceTime(glutGet(GLUT_ELAPSED_TIME)/1000.0);
+
+   //  Pick up edits to the wave set
+   checkWaves();
 
    Project();
 
@@ -390,6 +1114,11 @@ void idle()
 /* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 9*/
 void special(int key,int x,int y)
 {
+   //  Record the event, or ignore the user during an input replay
+   if (inrec)
+      InputWrite(inrec,nframe,wall,INPUT_SPECIAL,key,0);
+   else if (inplay && !injected)
+      return;
 
    		//  Look Right
    		if (key == GLUT_KEY_RIGHT) {
@@ -435,6 +1164,11 @@ void special(int key,int x,int y)
 /* FUNCTION ADAPTED FROM IN CLASS EXAMPLE 9*/
 void key(unsigned char ch,int x,int y)
 {
+   //  Record the event, or ignore the user (except ESC) during an input replay
+   if (inrec)
+      InputWrite(inrec,nframe,wall,INPUT_KEY,ch,0);
+   else if (inplay && !injected && ch!=27)
+      return;
    //  Exit on ESC
    if (ch == 27)
       	exit(0);
@@ -465,6 +1199,39 @@ void key(unsigned char ch,int x,int y)
    //  Toggle between mesh grid and quads
    else if (ch == 'm')
       mesh = 1-mesh;
+   //  Cycle the sincos accuracy tier
+   else if (ch == 'f') {
+      sctier = (sctier+1)%SINCOS_TIERS;
+      paramgen++;
+   }
+   //  Cycle the normal generation strategy
+   else if (ch == 'n') {
+      normmode = (normmode+1)%NORM_MODES;
+      paramgen++;
+   }
+   //  Pause, scrub and scale the simulation time
+   else if (ch == 'p')
+      paused = 1-paused;
+   else if (ch == '[')
+      t -= 0.05;
+   else if (ch == ']')
+      t += 0.05;
+   else if (ch == ',' && timescale>1.0/16)
+      timescale /= 2;
+   else if (ch == '.' && timescale<16)
+      timescale *= 2;
+   //  Toggle reduced resolution reflections
+   else if (ch == 'r')
+      lowres = 1-lowres;
+   //  Compare reduced and full resolution reflections
+   else if (ch == 'i')
+      imgdiff = 1;
+   //  Cycle the number of viewports
+   else if (ch == 'v')
+      nviews = nviews%MAXVIEW+1;
+   //  Start or stop capturing frames
+   else if (ch == 'c')
+      capture = 1-capture;
    //  Switch display mode
    else if (ch == '1')
    		mode = 1;
@@ -499,20 +1266,56 @@ void key(unsigned char ch,int x,int y)
 }
 
 
-void display() {
-	//  Clear the image
-   	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-   	//  Enable Z-buffering in OpenGL
-    glEnable(GL_DEPTH_TEST);
+/*
+ *  Advance an input replay by one time step and inject the events that are due
+ *     the replay ends with the end of the recording
+ *     a resize is checked a few frames later, since the window manager may clamp or ignore it
+ */
+static void replayInput() {
+	struct inputEvent ev;
+	if (replayframe>=0 && nframe>=replayframe+10) {
+		if (winw!=replayw || winh!=replayh)
+			fprintf(stderr,"Input replay: window is %dx%d at frame %d, recorded %dx%d at frame %d\n",winw,winh,nframe,replayw,replayh,replayframe);
+		replayframe = -1;
+	}
+	advanceTime(nframe*step);
+	injected = 1;
+	while (InputNext(inplay,wall,&ev)) {
+		if (ev.type==INPUT_KEY)
+			key(ev.a,0,0);
+		else if (ev.type==INPUT_SPECIAL)
+			special(ev.a,0,0);
+		else if (ev.type==INPUT_RESHAPE) {
+			replayw = ev.a;
+			replayh = ev.b;
+			replayframe = nframe;
+			glutReshapeWindow(ev.a,ev.b);
+		}
+		else
+			exit(0);
+	}
+	injected = 0;
+}
+
+/*-------------------------------------------------------------------------------------------------------
+											Views
+-------------------------------------------------------------------------------------------------------*/
+
+double viewclip[MAXVIEW][16];	// water to clip space matrix of each view
+static int viewcols=1;			// columns of viewports
+static int view0[3];			// mode, th and ph of view 0 while the others are set
+static double view0asp;			// aspect ratio of the window
+
+/*
+ *  Set the modelview matrix for the camera of the current mode
+ */
+static void camera() {
    	//  Reset previous transforms
    	glLoadIdentity();
 
    	//  Overhead perspective
    	if (mode == 1)
    	{
-   		glColor3f(1,1,1);
-    	glWindowPos2i(5,5);
-    	Print("th=%d ph=%d, mode: Overhead perspective",th,ph);
    		Ex = -2*dim*Sin(th)*Cos(ph);
       	Ey = +2*dim        *Sin(ph);
       	Ez = +2*dim*Cos(th)*Cos(ph);
@@ -520,22 +1323,314 @@ void display() {
    	}
    	//  First person perspective
    	else if (mode == 2){
-   		glColor3f(1,1,1);
-    	glWindowPos2i(5,5);
-    	Print("th=%d ph=%d, mode: First Person Perspective",th,ph);
    		gluLookAt(fx,fy,fz,  lx,ly,lz,  0,Cos(ph),0);
    	}
+}
+
+/*
+ *  Lay out nviews equally sized viewports and save the camera of view 0
+ */
+static void beginViews() {
+	int rows;
+	viewcols = nviews<=1 ? 1 : nviews<=4 ? 2 : 3;
+	rows = (nviews+viewcols-1)/viewcols;
+	vpw = winw/viewcols;
+	vph = winh/rows;
+	if (vpw<1) vpw = 1;
+	if (vph<1) vph = 1;
+	view0[0] = mode;
+	view0[1] = th;
+	view0[2] = ph;
+	view0asp = asp;
+}
 
-   	glShadeModel(GL_SMOOTH);
+/*
+ *  Set the viewport, projection and camera angles of view k
+ *     view 0 is the interactive camera, view 1 the other projection mode with
+ *     the same angles and the others fixed overhead monitor cameras
+ */
+static void setView(int k) {
+	vpx = (k%viewcols)*vpw;
+	vpy = winh-(k/viewcols+1)*vph;
+	asp = (double)vpw/vph;
+	if (k==1)
+		mode = 3-view0[0];
+	else if (k>1) {
+		mode = 1;
+		th = view0[1]+monitor[k-2][0];
+		ph = monitor[k-2][1];
+	}
+	Project();
+}
+
+/*
+ *  Restore the camera of view 0
+ */
+static void endViews() {
+	mode = view0[0];
+	th = view0[1];
+	ph = view0[2];
+	asp = view0asp;
+}
+
+/*
+ *  Water to clip space matrix of every view
+ */
+static void viewClip() {
+	double P[16],M[16];
+	int k,i,j,l;
+	beginViews();
+	for (k=0;k<nviews;k++) {
+		setView(k);
+		camera();
+		glRotatef(-90,1,0,0);
+		glGetDoublev(GL_PROJECTION_MATRIX,P);
+		glGetDoublev(GL_MODELVIEW_MATRIX,M);
+		for (i=0;i<4;i++)
+			for (j=0;j<4;j++) {
+				viewclip[k][i+4*j] = 0;
+				for (l=0;l<4;l++)
+					viewclip[k][i+4*j] += P[i+4*l]*M[l+4*j];
+			}
+	}
+	endViews();
+	Project();
+}
+
+/*
+ *  Could any view see the triangles touching grid points x0<=x<x1, y0<=y<y1?
+ *     the box around them is grown by one grid step for the triangles shared with
+ *     the next tiles and by the displacement and height ranges; it is out of a
+ *     view when all its corners are outside the same clip plane
+ */
+static int tileVisible(int x0,int x1,int y0,int y1) {
+	double box[2][3] = {{-dim+qstep*(x0-1)-drange,-dim+qstep*(y0-1)-drange,-hrange},
+	                    {-dim+qstep*x1+drange,-dim+qstep*y1+drange,hrange}};
+	int k,c,i;
+	for (k=0;k<nviews;k++) {
+		const double* C = viewclip[k];
+		int out[6] = {0,0,0,0,0,0};
+		for (c=0;c<8;c++) {
+			double v[4];
+			double x = box[c&1][0], y = box[(c>>1)&1][1], z = box[c>>2][2];
+			for (i=0;i<4;i++)
+				v[i] = C[i]*x + C[i+4]*y + C[i+8]*z + C[i+12];
+			for (i=0;i<3;i++) {
+				if (v[i]<-v[3]) out[2*i]++;
+				if (v[i]> v[3]) out[2*i+1]++;
+			}
+		}
+		for (i=0;i<6 && out[i]<8;i++);
+		if (i==6) return 1;
+	}
+	return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------------
+											End of Views
+-------------------------------------------------------------------------------------------------------*/
+
+/*
+ *  Bring the surface to time t and stream it to the GPU
+ *     tiles already computed for this time and these parameters are kept,
+ *     tiles out of every view are left until they come into view
+ */
+static void simulate() {
+	int tx,ty,k;
+	int list[ntile*ntile];	//  tiles computed this frame
+	//  Replay a recorded surface when the frame changes
+	if (play) {
+		k = StreamFind(play,t);
+		tilesdone = tilesculled = 0;
+		tilescurrent = ntile*ntile;
+		if (k!=playframe) {
+			StreamRead(play,k,(short*)packed);
+			uploadSurface();
+			playframe = k;
+			tilescurrent = 0;
+		}
+		return;
+	}
+	//  Compute the tiles in view that are not current
+	//  (a recording needs every tile of every frame)
+	viewClip();
+	tilesdone = tilescurrent = tilesculled = 0;
+	for (tx=0;tx<ntile;tx++) {
+		for (ty=0;ty<ntile;ty++) {
+			struct tileStamp* ts = &tiles[tx*ntile+ty];
+			int x0 = tx*TILE, x1 = x0+TILE<gridn ? x0+TILE : gridn;
+			int y0 = ty*TILE, y1 = y0+TILE<gridn ? y0+TILE : gridn;
+			if (ts->t==t && ts->gen==paramgen)
+				tilescurrent++;
+			else if (!rec && !tileVisible(x0,x1,y0,y1))
+				tilesculled++;
+			else {
+				computeHeights(x0,x1,y0,y1);
+				ts->t = t;
+				ts->gen = paramgen;
+				list[tilesdone++] = tx*ntile+ty;
+			}
+		}
+	}
+	if (!tilesdone) return;
+	//  Normals once all the heights are current
+	for (k=0;k<tilesdone;k++) {
+		tx = list[k]/ntile;
+		ty = list[k]%ntile;
+		int x0 = tx*TILE, x1 = x0+TILE<gridn ? x0+TILE : gridn;
+		int y0 = ty*TILE, y1 = y0+TILE<gridn ? y0+TILE : gridn;
+		//  Differences also need the heights along the edges of neighbours that are not current
+		if (normmode==NORM_DIFF) {
+			if (tx>0 && !tileCurrent(tx-1,ty)) computeHeights(x0-1,x0,y0,y1);
+			if (tx<ntile-1 && !tileCurrent(tx+1,ty)) computeHeights(x1,x1+1,y0,y1);
+			if (ty>0 && !tileCurrent(tx,ty-1)) computeHeights(x0,x1,y0-1,y0);
+			if (ty<ntile-1 && !tileCurrent(tx,ty+1)) computeHeights(x0,x1,y1,y1+1);
+		}
+		surfaceNorms(x0,x1,y0,y1);
+		packSurface(x0,x1,y0,y1);
+	}
+	if (quantcheck) {
+		checkQuantError();
+		quantcheck = 0;
+	}
+	if (rec) StreamWrite(rec,(short*)packed,t);
+	uploadSurface();
+}
+
+/*
+ *  Create or resize the reduced resolution reflection target
+ *     texture 0 holds the reflection color and specular intensity,
+ *     texture 1 the depth and depth squared used to find edges (0 where there is no water);
+ *     both are filtered linearly so pixlight.frag needs one fetch of each
+ */
+static void initLowres() {
+	GLenum bufs[] = {GL_COLOR_ATTACHMENT0,GL_COLOR_ATTACHMENT1};
+	int w = vpw*lowscale;
+	int h = vph*lowscale;
+	int k;
+	if (w<1) w = 1;
+	if (h<1) h = 1;
+	if (lowfbo && w==loww && h==lowh) return;
+	if (!lowfbo) {
+		glGenFramebuffers(1,&lowfbo);
+		glGenTextures(2,lowtex);
+		glGenRenderbuffers(1,&lowdepth);
+	}
+	loww = w;
+	lowh = h;
+	for (k=0;k<2;k++) {
+		glBindTexture(GL_TEXTURE_2D,lowtex[k]);
+		if (k==0)
+			glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA8,w,h,0,GL_RGBA,GL_UNSIGNED_BYTE,NULL);
+		else
+			glTexImage2D(GL_TEXTURE_2D,0,GL_RG32F,w,h,0,GL_RG,GL_FLOAT,NULL);
+		glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D,0);
+	glBindRenderbuffer(GL_RENDERBUFFER,lowdepth);
+	glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,w,h);
+	glBindRenderbuffer(GL_RENDERBUFFER,0);
+	glBindFramebuffer(GL_FRAMEBUFFER,lowfbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_TEXTURE_2D,lowtex[0],0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT1,GL_TEXTURE_2D,lowtex[1],0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,lowdepth);
+	glDrawBuffers(2,bufs);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE)
+		Fatal("Reduced resolution target %dx%d is incomplete\n",w,h);
+	glBindFramebuffer(GL_FRAMEBUFFER,0);
+	//  Texture bindings changed behind the state filter
+	StReset();
+	fprintf(stderr,"Reduced resolution reflections: %dx%d\n",w,h);
+}
+
+/*
+ *  Draw the water
+ *     in reduced resolution mode the reflection and specular terms are shaded
+ *     into the reduced resolution target first and upsampled by pixlight.frag
+ */
+static void drawWater() {
+	if (queryview>=0) glBeginQuery(GL_TIME_ELAPSED,wquery[queryview]);
+	if (lowres && !mesh) {
+		//  Reflection and specular at reduced resolution
+		initLowres();
+		glBindFramebuffer(GL_FRAMEBUFFER,lowfbo);
+		glViewport(0,0,loww,lowh);
+		glScissor(0,0,loww,lowh);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		StUseProgram(shader[2]);
+		drawSurface(2);
+		glBindFramebuffer(GL_FRAMEBUFFER,0);
+		glViewport(vpx,vpy,vpw,vph);
+		glScissor(vpx,vpy,vpw,vph);
+		//  Full resolution lighting with upsampled reflection and specular
+		StUseProgram(shader[1]);
+		glUniform1i(uploc,1);
+		glUniform2f(lowsizeloc,loww,lowh);
+		glUniform2f(lowscaleloc,(double)loww/vpw,(double)lowh/vph);
+		glUniform2f(loworgloc,vpx,vpy);
+		glUniform1i(countloc,countwater==2);
+		StActiveTexture(GL_TEXTURE1);
+		StBindTexture(GL_TEXTURE_2D,lowtex[0]);
+		StActiveTexture(GL_TEXTURE2);
+		StBindTexture(GL_TEXTURE_2D,lowtex[1]);
+		StActiveTexture(GL_TEXTURE0);
+	}
+	else {
+		StUseProgram(shader[1]);
+		glUniform1i(uploc,0);
+	}
+	if (countwater) glBeginQuery(GL_SAMPLES_PASSED,squery);
+	drawSurface(1);
+	if (countwater) {
+		GLuint n=0;
+		glEndQuery(GL_SAMPLES_PASSED);
+		glGetQueryObjectuiv(squery,GL_QUERY_RESULT,&n);
+		watersamples += n;
+	}
+	if (queryview>=0) glEndQuery(GL_TIME_ELAPSED);
+}
+
+/*
+ *  Wait for the GPU time of the water in the last timed views in ms
+ *     timer queries cannot nest, so each view has its own and they are summed
+ */
+static double waterTime() {
+	double ms=0;
+	int k;
+	for (k=0;k<querypending;k++) {
+		GLuint64 ns=0;
+		glGetQueryObjectui64v(wquery[k],GL_QUERY_RESULT,&ns);
+		ms += ns*1e-6;
+	}
+	waterviews = querypending;
+	querypending = 0;
+	return ms;
+}
+
+/*
+ *  Draw the scene from the current camera
+ */
+static void drawScene() {
+	//  Clear the image
+   	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   	//  Enable Z-buffering in OpenGL
+    StEnable(GL_DEPTH_TEST,1);
+   	//  Camera
+   	camera();
+
+   	StShadeModel(GL_SMOOTH);
 
    	if (!day) {
    		glPushMatrix();
    		glRotatef(-90,1,0,0);
-   		Sky(2*dim);
+   		Sky();
    		glPopMatrix();
    	}
    	else
-   		Sky(2*dim);
+   		Sky();
 
 
   	//  Translate intensity to color vectors
@@ -550,20 +1645,21 @@ void display() {
 	glColor3f(1,1,1);
 	sphere(Position[0],Position[1],Position[2] , 5);
 	//  OpenGL should normalize normal vectors
-	glEnable(GL_NORMALIZE);
+	StEnable(GL_NORMALIZE,1);
 	//  Enable lighting
-	glEnable(GL_LIGHTING);
+	StEnable(GL_LIGHTING,1);
 	//  Location of viewer for specular calculations
-	glLightModeli(GL_LIGHT_MODEL_LOCAL_VIEWER,local);
+	StLightModeli(GL_LIGHT_MODEL_LOCAL_VIEWER,local);
 	//  glColor sets ambient and diffuse color materials
-	glColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
-	glEnable(GL_COLOR_MATERIAL);
+	StColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
+	StEnable(GL_COLOR_MATERIAL,1);
 	//  Enable light 0
-	glEnable(GL_LIGHT0);
+	StEnable(GL_LIGHT0,1);
 	//  Set ambient, diffuse, specular components and position of light 0
-	glLightfv(GL_LIGHT0,GL_AMBIENT ,Ambient);
-	glLightfv(GL_LIGHT0,GL_DIFFUSE ,Diffuse);
-	glLightfv(GL_LIGHT0,GL_SPECULAR,Specular);
+	StLightfv(GL_LIGHT0,GL_AMBIENT ,Ambient);
+	StLightfv(GL_LIGHT0,GL_DIFFUSE ,Diffuse);
+	StLightfv(GL_LIGHT0,GL_SPECULAR,Specular);
+	//  Position is transformed by the view, always set it
 	glLightfv(GL_LIGHT0,GL_POSITION,Position);
 
 	
@@ -571,53 +1667,350 @@ void display() {
 
 
 	//  Set materials
-   glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,Shinyness);
-   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,Specular);
-   glMaterialfv(GL_FRONT_AND_BACK,GL_EMISSION,Emission);
-
-  	glUseProgram(shader[1]);
-
-   	computeHeights();
-   	computeNorms();
+   StMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,Shinyness);
+   StMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,Specular);
+   StMaterialfv(GL_FRONT_AND_BACK,GL_EMISSION,Emission);
 
-   	glEnable(GL_TEXTURE_CUBE_MAP);
-   	glActiveTexture(GL_TEXTURE0);
-   	glBindTexture(GL_TEXTURE_CUBE_MAP,day ? texture[1] : texture[3]);
+   	StEnable(GL_TEXTURE_CUBE_MAP,1);
+   	StActiveTexture(GL_TEXTURE0);
+   	StBindTexture(GL_TEXTURE_CUBE_MAP,day ? texture[1] : texture[3]);
 
-   	int x,y;
-   	for (x=0;x<(2*dim)/qstep-1;x++) {
-   		for (y=0;y<(2*dim)/qstep-1;y++) {
-   			glBegin(mesh ? GL_LINE_STRIP : GL_QUAD_STRIP);
-   			glColor3f(0,0,1);
- 
-   			glNormal3f(xnorm[x][y], ynorm[x][y], znorm[x][y]);
-   			glVertex3d(xmap[x][y], ymap[x][y], zmap[x][y]);
+   	//  Draw the packed surface
+   	glColor3f(0,0,1);
+   	drawWater();
 
-   			glNormal3f(xnorm[x][y+1], ynorm[x][y+1], znorm[x][y+1]);
-   			glVertex3d(xmap[x][y+1], ymap[x][y+1], zmap[x][y+1]);
+  	StUseProgram(0);
+  	StEnable(GL_TEXTURE_CUBE_MAP,0);
+   	StEnable(GL_LIGHTING,0);
+}
 
-   			glNormal3f(xnorm[x+1][y], ynorm[x+1][y], znorm[x+1][y]);
-   			glVertex3d(xmap[x+1][y], ymap[x+1][y], zmap[x+1][y]);
+/*
+ *  Draw the scene into nviews viewports from the surface of this frame
+ *     viewports are all the same size so they share the reduced resolution target
+ */
+static void drawViews() {
+	int k,timed=!querypending;
+	beginViews();
+	StEnable(GL_SCISSOR_TEST,1);
+	//  Clear the pixels left over by the tiles
+	if (nviews>1) {
+		glScissor(0,0,winw,winh);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+	for (k=0;k<nviews;k++) {
+		setView(k);
+		glViewport(vpx,vpy,vpw,vph);
+		glScissor(vpx,vpy,vpw,vph);
+		queryview = timed ? k : -1;
+		drawScene();
+	}
+	queryview = -1;
+	if (timed) querypending = nviews;
+	endViews();
+	glViewport(0,0,winw,winh);
+	glScissor(0,0,winw,winh);
+}
 
-   			glNormal3f(xnorm[x+1][y+1], ynorm[x+1][y+1], znorm[x+1][y+1]);
-   			glVertex3d(xmap[x+1][y+1], ymap[x+1][y+1], zmap[x+1][y+1]);
+/*
+ *  Draw the frame with full and reduced resolution reflections and compare them
+ *     the reduced resolution image is left in the back buffer
+ *     the frames are also timed to glFinish, since renderers that defer
+ *     rasterization (such as Mesa llvmpipe) leave it out of the timer query
+ *     the water pixels and those that fall back to full resolution shading
+ *     are counted in two untimed passes first
+ */
+static void compareLowres() {
+	int k,n=3*winw*winh,max=0,over=0;
+	int save=lowres;
+	double sse=0,tfull,tlow,ffull,flow;
+	unsigned int all,fallback;
+	unsigned char* img = (unsigned char*)malloc(2*n);
+	if (!img) Fatal("Cannot allocate %d bytes for image comparison\n",2*n);
+	if (querypending) waterTime();
+	glPixelStorei(GL_PACK_ALIGNMENT,1);
+	//  Water pixels, and those shaded at full resolution with reduced resolution reflections
+	lowres = 1;
+	countwater = 1;
+	watersamples = 0;
+	drawViews();
+	all = watersamples;
+	countwater = 2;
+	watersamples = 0;
+	drawViews();
+	fallback = watersamples;
+	countwater = 0;
+	waterTime();
+	//  Full resolution reference
+	lowres = 0;
+	glFinish();
+	ffull = Now();
+	drawViews();
+	glFinish();
+	ffull = Now()-ffull;
+	tfull = waterTime();
+	glReadPixels(0,0,winw,winh,GL_RGB,GL_UNSIGNED_BYTE,img);
+	//  Reduced resolution (the target is created outside the timed frame)
+	lowres = 1;
+	initLowres();
+	glFinish();
+	flow = Now();
+	drawViews();
+	glFinish();
+	flow = Now()-flow;
+	tlow = waterTime();
+	glReadPixels(0,0,winw,winh,GL_RGB,GL_UNSIGNED_BYTE,img+n);
+	lowres = save;
+	//  Image difference
+	for (k=0;k<n;k++) {
+		int d = abs(img[k]-img[n+k]);
+		sse += d*d;
+		if (d>max) max = d;
+		if (d>8) over++;
+	}
+	fprintf(stderr,"Reflections x%.2f vs full in %d views: water %.3f ms vs %.3f ms GPU, frame %.3f ms vs %.3f ms to glFinish, %.2f%% of water pixels shaded at full resolution, RMSE %.3f, PSNR %.1f dB, max %d, %.3f%% of samples off by more than 8\n",
+		lowscale,nviews,tlow,tfull,flow,ffull,all ? 100.0*fallback/all : 0.0,sqrt(sse/n),sse>0 ? 10*log10(255.0*255.0*n/sse) : 99.0,max,100.0*over/n);
+	free(img);
+	imgdiff = 0;
+}
 
-   			glEnd();
-   		}
-   	} 
+/*
+ *  Text overlay
+ */
+static void overlay() {
+   	glColor3f(1,1,1);
+   	glWindowPos2i(5,5);
+   	if (mode == 1)
+    	Print("th=%d ph=%d, mode: Overhead perspective, sincos: %s, normals: %s",th,ph,SinCosName[sctier],normname[normmode]);
+   	else if (mode == 2)
+    	Print("th=%d ph=%d, mode: First Person Perspective, sincos: %s, normals: %s",th,ph,SinCosName[sctier],normname[normmode]);
+   	glWindowPos2i(5,25);
+   	Print("GL state calls: %d issued, %d redundant skipped",stissued,stskipped);
+   	glWindowPos2i(5,45);
+   	if (lowres)
+   		Print("water %.2f ms GPU in %d views, reflections x%.2f",watertime,waterviews,lowscale);
+   	else
+   		Print("water %.2f ms GPU in %d views, reflections full",watertime,waterviews);
+   	glWindowPos2i(5,65);
+   	Print("views: %d, simulate %.2f ms, draw %.2f ms CPU",nviews,simtime,drawtime);
+   	glWindowPos2i(5,85);
+   	Print("t=%.2f x%g%s, tiles: %d computed, %d current, %d out of view, evaluation skipped %d of %d frames",
+   		t,timescale,paused ? " paused" : "",tilesdone,tilescurrent,tilesculled,skipframes,evalframes+skipframes);
+   	if (cap) {
+   		glWindowPos2i(5,105);
+   		Print("capture: %d frames, %d dropped, %.2f ms/frame",cap->frames,cap->dropped,cap->frames ? cap->readtime/cap->frames : 0.0);
+   	}
+}
 
-  	glUseProgram(0);
-  	glDisable(GL_TEXTURE_CUBE_MAP);
-   	glDisable(GL_LIGHTING);
+void display() {
+	//  GPU time of the water in the last timed views
+	if (querypending) {
+		int avail=0;
+		glGetQueryObjectiv(wquery[querypending-1],GL_QUERY_RESULT_AVAILABLE,&avail);
+		if (avail) watertime = waterTime();
+	}
 
+	//  Replayed input runs in fixed time steps
+	if (inplay) replayInput();
+
+	//  One simulation step for all the views
+	double t0 = Now();
+	simulate();
+	double t1 = Now();
+	if (tilesdone)
+		evalframes++;
+	else
+		skipframes++;
+	if (imgdiff)
+		compareLowres();
+	else
+		drawViews();
+	drawtime = Now()-t1;
+	simtime = t1-t0;
+	//  Capture before the overlay is drawn
+	if (capture && !cap)
+		cap = CaptureCreate(capfile,winw,winh,30);
+	else if (!capture && cap) {
+		CaptureClose(cap);
+		cap = NULL;
+	}
+	if (cap) CaptureFrame(cap,winw,winh);
+	overlay();
+   	StFrame(&stissued,&stskipped);
 
    	glFlush();
    	glutSwapBuffers();
 
+   	//  Frame times (the first frame has no interval)
+   	double t2 = Now();
+   	if (stats && nframe) {
+   		double ms[NSTAT] = {simtime,drawtime,t2-lastframe};
+   		StatsAdd(stats,nframe,t,ms);
+   	}
+   	lastframe = t2;
+   	nframe++;
+}
+
+/*
+ *  Validate the fast sincos tiers over the phases this wave set reaches
+ *     phase = w*(d.x) + p_const*t for |x| up to the displaced edge of the grid
+ */
+static int checkSinCos() {
+	const double runtime[] = {60,3600,86400,604800};
+	const char* label[] = {"1 minute","1 hour","1 day","1 week","2^33 quads"};
+	double maxphase[5];
+	int i,k;
+	quantRanges();
+	for (k=0;k<4;k++) {
+		maxphase[k] = 0;
+		for (i=0;i<nwaves;i++) {
+			double p = waves[i].w*(fabs(waves[i].dx)+fabs(waves[i].dy))*(dim+drange) + waves[i].p_const*runtime[k];
+			if (p>maxphase[k]) maxphase[k] = p;
+		}
+	}
+	//  Past the quadrants the SSE2 pairs can hold, where the scalar path takes over
+	maxphase[4] = 90*8589934592.0;
+	return SinCosCheck(5,maxphase,label) ? 1 : 0;
+}
+
+/*
+ *  Benchmark the normal strategies against the analytic normals
+ *     every strategy runs on the whole grid for the same frames; the error is
+ *     the angle to the analytic normal and the time is for the normals alone
+ */
+static int checkNormals() {
+	const int frames=100;
+	static double ref[3][200][200];
+	double ms[NORM_MODES],sum[NORM_MODES],max[NORM_MODES],hms=0;
+	int f,m,x,y;
+	gridn = (2*dim)/qstep;
+	for (m=0;m<NORM_MODES;m++)
+		ms[m] = sum[m] = max[m] = 0;
+	for (f=0;f<frames;f++) {
+		double t0 = Now();
+		t = f/30.0;
+		computeHeights(0,gridn,0,gridn);
+		hms += Now()-t0;
+		for (m=0;m<NORM_MODES;m++) {
+			normmode = m;
+			t0 = Now();
+			surfaceNorms(0,gridn,0,gridn);
+			ms[m] += Now()-t0;
+			for (x=0;x<gridn;x++) {
+				for (y=0;y<gridn;y++) {
+					double n[3] = {xnorm[x][y],ynorm[x][y],znorm[x][y]};
+					if (m==NORM_ANALYTIC) {
+						ref[0][x][y] = n[0];
+						ref[1][x][y] = n[1];
+						ref[2][x][y] = n[2];
+					}
+					else {
+						double c = (n[0]*ref[0][x][y]+n[1]*ref[1][x][y]+n[2]*ref[2][x][y]) /
+							sqrt((n[0]*n[0]+n[1]*n[1]+n[2]*n[2])*(ref[0][x][y]*ref[0][x][y]+ref[1][x][y]*ref[1][x][y]+ref[2][x][y]*ref[2][x][y]));
+						double a = acos(c>1 ? 1 : c<-1 ? -1 : c)*180/PI;
+						sum[m] += a;
+						if (a>max[m]) max[m] = a;
+					}
+				}
+			}
+		}
+	}
+	printf("%dx%d grid, %d waves, %d frames, sincos %s\n",gridn,gridn,nwaves,frames,SinCosName[sctier]);
+	printf("%-16s %10s %12s %12s\n","normals","ms/frame","mean error","max error");
+	for (m=0;m<NORM_MODES;m++)
+		printf("%-16s %10.3f %11.4f%c %11.4f%c\n",normname[m],ms[m]/frames,sum[m]/(frames*gridn*gridn),m ? 'd' : ' ',max[m],m ? 'd' : ' ');
+	printf("%-16s %10.3f\n","(heights)",hms/frames);
+	return 0;
+}
 
+/* Finish the surface streams, capture, input traces and statistics when the program exits */
+static void closeStreams() {
+	StreamClose(rec);
+	StreamClose(play);
+	CaptureClose(cap);
+	InputClose(inrec,nframe,wall);
+	InputClose(inplay,nframe,wall);
+	StatsReport(stats);
+	rec = play = NULL;
+	cap = NULL;
+	inrec = inplay = NULL;
+	stats = NULL;
 }
 
 int main(int argc,char* argv[]) {
+	char* surfattr[] = {"Grid","Offset","Oct",NULL};	//  packed surface attributes
+	char* recfile=NULL;		//  file to record the surface to
+	char* playfile=NULL;	//  file to replay the surface from
+	char* wavearg=NULL;		//  wave set file given on the command line
+	char* inrecfile=NULL;	//  file to record the input events to
+	char* inplayfile=NULL;	//  file to replay the input events from
+	char* statsfile=NULL;	//  file to write the frame times to
+	int checksincos=0;		//  validate the sincos tiers and exit
+	int checknormals=0;		//  benchmark the normal strategies and exit
+	int k;
+	//  Command line options (parsed before GLUT so checks run without a display)
+	for (k=1;k<argc;k++) {
+		if (!strcmp(argv[k],"-record") && k+1<argc)
+			recfile = argv[++k];
+		else if (!strcmp(argv[k],"-replay") && k+1<argc)
+			playfile = argv[++k];
+		else if (!strcmp(argv[k],"-waves") && k+1<argc)
+			wavefile = wavearg = argv[++k];
+		else if (!strcmp(argv[k],"-checksincos"))
+			checksincos = 1;
+		else if (!strcmp(argv[k],"-checknormals"))
+			checknormals = 1;
+		else if (!strcmp(argv[k],"-normals") && k+1<argc) {
+			for (normmode=0;normmode<NORM_MODES && strcmp(argv[k+1],normname[normmode]);normmode++);
+			if (normmode==NORM_MODES) Fatal("Normals must be analytic, differences or dominant+detail\n");
+			k++;
+		}
+		else if (!strcmp(argv[k],"-capture") && k+1<argc) {
+			capture = 1;
+			capfile = argv[++k];
+		}
+		else if (!strcmp(argv[k],"-recordinput") && k+1<argc)
+			inrecfile = argv[++k];
+		else if (!strcmp(argv[k],"-replayinput") && k+1<argc)
+			inplayfile = argv[++k];
+		else if (!strcmp(argv[k],"-step") && k+1<argc) {
+			step = strtod(argv[++k],NULL);
+			if (step<=0) Fatal("Time step must be positive\n");
+		}
+		else if (!strcmp(argv[k],"-stats") && k+1<argc)
+			statsfile = argv[++k];
+		else if (!strcmp(argv[k],"-views") && k+1<argc) {
+			nviews = atoi(argv[++k]);
+			if (nviews<1 || nviews>MAXVIEW) Fatal("Number of views must be 1 to %d\n",MAXVIEW);
+		}
+		else if (!strcmp(argv[k],"-lowres") && k+1<argc) {
+			lowres = 1;
+			lowscale = strtod(argv[++k],NULL);
+			if (lowscale<=0 || lowscale>1) Fatal("Reduced resolution scale must be in (0,1]\n");
+		}
+		else
+			Fatal("Usage: %s [-record file] [-replay file] [-waves file] [-lowres scale] [-views n] [-capture file]\n"
+				"   [-recordinput file] [-replayinput file] [-step seconds] [-stats file]\n"
+				"   [-normals analytic|differences|dominant+detail] [-checksincos] [-checknormals]\n",argv[0]);
+	}
+	if (inrecfile && inplayfile) Fatal("Cannot record and replay input at the same time\n");
+
+	//  Wave set from the wave file, built in set if there is none
+	if (loadWaves(wavefile)) {
+		struct stat st;
+		if (!stat(wavefile,&st)) {
+			wavetime = st.st_mtime;
+			wavesize = st.st_size;
+		}
+	}
+	else if (wavearg)
+		Fatal("Cannot load wave set %s\n",wavefile);
+	else
+		defaultWaves();
+	if (checksincos)
+		return checkSinCos();
+	if (checknormals)
+		return checkNormals();
+
   	//  Inittialize GLUT
 	glutInit(&argc,argv);
   	//  Request double buffered, true color window with Z buffering
@@ -632,20 +2025,48 @@ int main(int argc,char* argv[]) {
   	glutKeyboardFunc(key);
   	glutIdleFunc(idle);
 
- 	waves[0] = addWave(232,.2,.3);
-	waves[1] = addWave(106,.1,.2);
-	waves[2] = addWave(16,.3,.1);
-	waves[3] = addWave(338,.1,.3);
-	waves[4] = addWave(56,.0005,.01);
-	waves[5] = addWave(176,.001,.02);
-	waves[6] = addWave(89,.002,.03);
-	waves[7] = addWave(202,.004,.04);
-
 	texture[0] = LoadTexBMP("textures/sky_cube.bmp");	
   	texture[1] = LoadCubeTexBMP(daysides);
   	texture[2] = LoadTexBMP("textures/nightsky.bmp");
   	texture[3] = LoadCubeTexBMP(nightsides);
-  	shader[1] = CreateShaderProg("pixlight.vert","pixlight.frag");
+  	shader[1] = CreateShaderProg("pixlight.vert","pixlight.frag",surfattr);
+  	shader[2] = CreateShaderProg("pixlight.vert","reflect.frag",surfattr);
+  	//  Reduced resolution targets are read from texture units 1 and 2
+  	glUseProgram(shader[1]);
+  	glUniform1i(glGetUniformLocation(shader[1],"LowColor"),1);
+  	glUniform1i(glGetUniformLocation(shader[1],"LowGeom"),2);
+  	uploc = glGetUniformLocation(shader[1],"Upsample");
+  	lowsizeloc = glGetUniformLocation(shader[1],"LowSize");
+  	lowscaleloc = glGetUniformLocation(shader[1],"LowScale");
+  	loworgloc = glGetUniformLocation(shader[1],"LowOrigin");
+  	countloc = glGetUniformLocation(shader[1],"CountFallback");
+  	glUseProgram(0);
+  	glGenQueries(MAXVIEW,wquery);
+  	glGenQueries(1,&squery);
+  	//  A replayed stream sets the size of the surface
+  	if (playfile) {
+  		play = StreamOpen(playfile);
+  		dim = play->hdr.dim;
+  		qstep = play->hdr.qstep;
+  	}
+  	initSurface();
+  	initSphere();
+  	initSky(2*dim);
+  	if (play) {
+  		//  The stream must match the surface buffers it is read into
+  		if (play->hdr.gridn!=gridn || play->hdr.nfield!=sizeof(struct packedVertex)/sizeof(short))
+  			Fatal("%s is a %dx%d grid of %d shorts per vertex, expected %dx%d of %d\n",playfile,
+  				play->hdr.gridn,play->hdr.gridn,play->hdr.nfield,gridn,gridn,(int)(sizeof(struct packedVertex)/sizeof(short)));
+  		drange = play->hdr.drange;
+  		hrange = play->hdr.hrange;
+  	}
+  	else if (recfile)
+  		rec = StreamCreate(recfile,gridn,sizeof(struct packedVertex)/sizeof(short),dim,qstep,drange,hrange);
+  	//  Input traces and frame time statistics (always kept for an input replay)
+  	if (inrecfile) inrec = InputCreate(inrecfile);
+  	if (inplayfile) inplay = InputOpen(inplayfile);
+  	if (statsfile || inplay) stats = StatsCreate(statsfile);
+  	atexit(closeStreams);
 
   	//  Pass control to GLUT so it can interact with the user
   	glutMainLoop();
@@ -0,0 +1,30 @@
+//  Reduced resolution reflection and specular shader
+//  Writes the terms pixlight.frag upsamples: the reflection color and
+//  specular intensity, and the depth and depth squared whose bilinear
+//  average tells pixlight.frag whether the texels can be blended
+
+varying vec3 View;
+varying vec3 Light;
+varying vec3 Normal;
+
+uniform samplerCube skyBox;
+
+void main()
+{
+   //  N is the object normal
+   vec3 N = normalize(Normal);
+   //  L is the light vector
+   vec3 L = normalize(Light);
+   //  R is the reflected light vector R = 2(L.N)N - L
+   vec3 R = reflect(-L,N);
+   //  V is the view vector (eye vector)
+   vec3 V = normalize(View);
+
+   //  Specular is cosine of reflected and view vectors
+   float Is = (dot(L,N)>0.0) ? pow(max(dot(R,V),0.0) , gl_FrontMaterial.shininess) : 0.0;
+
+   //  Reflect the view vector to sample the cube map texture
+   gl_FragData[0] = vec4(textureCube(skyBox,reflect(-V,N)).rgb , Is);
+   //  Moments of the distance along the view axis
+   gl_FragData[1] = vec4(View.z , View.z*View.z , 0.0 , 0.0);
+}
@@ -0,0 +1,70 @@
+/*
+ *  Fast sine and cosine of angles in degrees
+ *
+ *  The angle is reduced exactly to r in [-45,45] degrees and quadrant n
+ *  (deg = 90n + r), a polynomial gives sin and cos of r, and the quadrant
+ *  swaps and negates them.  The tier picks the polynomial length:
+ *     SINCOS_LOW   max error 1e-3
+ *     SINCOS_MED   max error 1e-5
+ *     SINCOS_FULL  double precision
+ *     SINCOS_LIBM  libm through the Sin()/Cos() macros
+ *  Pairs of angles are done with SSE2 when it is available.
+ *  The kernels are inline in water.h so the surface kernels specialized
+ *  for a wave count keep a sine/cosine loop of known length; this file has
+ *  the tier names and the check against libm.
+ */
+#include "water.h"
+
+const char* SinCosName[] = {"1e-3","1e-5","full","libm"};
+
+/*
+ *  Validate the tiers against libm
+ *     maxphase[] are the largest phases (degrees) reached after the run times in label[]
+ *     the reference is libm on the exactly reduced angle, so the libm tier
+ *     also shows the error of Sin()/Cos() on large unreduced angles
+ *  Returns the number of tiers that exceed their bound
+ */
+int SinCosCheck(int nrange,const double* maxphase,const char* label[])
+{
+   const double bound[] = {1e-3,1e-5,1e-14};
+   const int N = 1<<21;
+   int i,k,tier,fail=0;
+   double* deg = (double*)malloc(3*N*sizeof(double));
+   double* s = deg+N;
+   double* c = deg+2*N;
+   if (!deg) Fatal("Cannot allocate %d angles\n",N);
+   printf("%-12s %12s","phase range","degrees");
+   for (tier=0;tier<SINCOS_TIERS;tier++)
+      printf(" %10s",SinCosName[tier]);
+   printf("\n");
+   srand(1);
+   for (i=0;i<nrange;i++)
+   {
+      //  Uniform angles over the range plus quadrant boundaries near its end
+      for (k=0;k<N;k++)
+         deg[k] = maxphase[i]*(2.0*rand()/RAND_MAX-1);
+      for (k=0;k<1024;k++)
+         deg[k] = 90*floor(maxphase[i]/90-k)+(k%3-1)*1e-9;
+      printf("%-12s %12.4g",label[i],maxphase[i]);
+      for (tier=0;tier<SINCOS_TIERS;tier++)
+      {
+         double err=0;
+         SinCosDeg(N,deg,s,c,tier);
+         for (k=0;k<N;k++)
+         {
+            double r = fmod(deg[k],360)*(PI/180);
+            double es = fabs(s[k]-sin(r));
+            double ec = fabs(c[k]-cos(r));
+            if (es>err) err = es;
+            if (ec>err) err = ec;
+         }
+         //  libm is reported but has no bound to meet on large angles
+         if (tier!=SINCOS_LIBM && err>bound[tier]) fail++;
+         printf(" %10.2e",err);
+      }
+      printf("\n");
+   }
+   printf("bounds       %12s %10.0e %10.0e %10.0e %10s\n","",bound[0],bound[1],bound[2],"-");
+   free(deg);
+   return fail;
+}
@@ -30,6 +30,7 @@ void Fatal(const char* format , ...);
 unsigned int LoadTexBMP(const char* file);
 unsigned int LoadCubeTexBMP(const char* files[]);
 void ErrCheck(const char* where);
+double Now(void);
 
 #ifdef __cplusplus
 }
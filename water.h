@@ -0,0 +1,319 @@
+#ifndef water
+#define water
+
+#include "texLoad.h"
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ *  Surface frame stream (framestream.c)
+ *     frames are arrays of quantized shorts, stored as zigzag varint deltas against the
+ *     previous frame with a key frame every keyint frames and an index at the end of the file
+ */
+struct streamHeader {
+   char     magic[4];      //  "WSS1"
+   int32_t  gridn;         //  grid points per side
+   int32_t  nfield;        //  shorts per vertex
+   int32_t  keyint;        //  frames between key frames
+   int32_t  nframes;       //  number of frames in the index
+   int32_t  pad;
+   double   dim,qstep;     //  grid extent and spacing
+   double   drange,hrange; //  quantization ranges for displacement and height
+   uint64_t index;         //  file offset of the frame index
+};
+
+struct streamIndex {
+   uint64_t offset;        //  file offset of the frame
+   uint32_t size;          //  encoded size in bytes
+   uint32_t key;           //  key frame (delta against zero)
+   double   t;             //  simulation time of the frame
+};
+
+struct frameStream {
+   struct streamHeader hdr;
+   struct streamIndex* index;
+   int      nalloc;        //  allocated index entries
+   int      count;         //  shorts per frame
+   short*   prev;          //  previous frame (writer) or last decoded frame (reader)
+   int      cur;           //  frame held in prev when reading
+   unsigned char* buf;     //  encode buffer
+   FILE*    f;             //  output file when writing
+   unsigned char* map;     //  mapped file when reading
+   size_t   size;          //  size of the mapped file
+   double   enctime;       //  seconds spent encoding
+   int      skipped;       //  frames not written because time did not advance
+};
+
+struct frameStream* StreamCreate(const char* file,int gridn,int nfield,double dim,double qstep,double drange,double hrange);
+void StreamWrite(struct frameStream* s,const short* frame,double t);
+struct frameStream* StreamOpen(const char* file);
+int StreamFind(struct frameStream* s,double t);
+void StreamRead(struct frameStream* s,int k,short* frame);
+void StreamClose(struct frameStream* s);
+
+/*
+ *  Fast sine and cosine of angles in degrees (sincos.c)
+ *     inline so callers with a constant angle count get a loop of known length
+ */
+#define SINCOS_LOW   0   //  max error 1e-3
+#define SINCOS_MED   1   //  max error 1e-5
+#define SINCOS_FULL  2   //  double precision
+#define SINCOS_LIBM  3   //  libm
+#define SINCOS_TIERS 4
+
+extern const char* SinCosName[];
+int SinCosCheck(int nrange,const double* maxphase,const char* label[]);
+
+//  Taylor coefficients
+#define S3  (-1.0/6)
+#define S5  (+1.0/120)
+#define S7  (-1.0/5040)
+#define S9  (+1.0/362880)
+#define S11 (-1.0/39916800)
+#define S13 (+1.0/6227020800)
+#define S15 (-1.0/1307674368000)
+#define C2  (-1.0/2)
+#define C4  (+1.0/24)
+#define C6  (-1.0/720)
+#define C8  (+1.0/40320)
+#define C10 (-1.0/3628800)
+#define C12 (+1.0/479001600)
+#define C14 (-1.0/87178291200)
+#define C16 (+1.0/20922789888000)
+
+/*
+ *  Polynomials on [-PI/4,PI/4]
+ *     x2 is r*r, the result for sin still needs to be multiplied by r
+ */
+static inline double SinPoly(double x2,int tier)
+{
+   if (tier==SINCOS_LOW)
+      return 1+x2*(S3+x2*S5);
+   else if (tier==SINCOS_MED)
+      return 1+x2*(S3+x2*(S5+x2*S7));
+   else
+      return 1+x2*(S3+x2*(S5+x2*(S7+x2*(S9+x2*(S11+x2*(S13+x2*S15))))));
+}
+
+static inline double CosPoly(double x2,int tier)
+{
+   if (tier==SINCOS_LOW)
+      return 1+x2*(C2+x2*C4);
+   else if (tier==SINCOS_MED)
+      return 1+x2*(C2+x2*(C4+x2*C6));
+   else
+      return 1+x2*(C2+x2*(C4+x2*(C6+x2*(C8+x2*(C10+x2*(C12+x2*(C14+x2*C16)))))));
+}
+
+/*
+ *  Sine and cosine of one angle in degrees
+ */
+static inline void SinCos1(double deg,double* s,double* c,int tier)
+{
+   double n = floor(deg/90+0.5);
+   double r = (deg-90*n)*(PI/180);
+   double x2 = r*r;
+   double sr = r*SinPoly(x2,tier);
+   double cr = CosPoly(x2,tier);
+   switch ((long long)n & 3)
+   {
+      case 0: *s =  sr; *c =  cr; break;
+      case 1: *s =  cr; *c = -sr; break;
+      case 2: *s = -sr; *c = -cr; break;
+      case 3: *s = -cr; *c =  sr; break;
+   }
+}
+
+#ifdef __SSE2__
+//  Largest angle whose quadrant fits the 32 bit conversion in SinCos2
+#define SSE_RANGE (90*1073741824.0)
+
+/*
+ *  Sine and cosine of two angles in degrees
+ *     the quadrant goes through a 32 bit integer, which saturates for
+ *     |deg| of 90*2^31 and more, so angles must be below SSE_RANGE
+ */
+static inline void SinCos2(const double* deg,double* s,double* c,int tier)
+{
+   const __m128d half = _mm_set1_pd(0.5);
+   const __m128i one  = _mm_set1_epi32(1);
+   const __m128i sign = _mm_set1_epi64x(0x8000000000000000LL);
+   __m128d d  = _mm_loadu_pd(deg);
+   __m128d fn = _mm_add_pd(_mm_mul_pd(d,_mm_set1_pd(1.0/90)),half);
+   //  Floor (truncate then correct negative values)
+   __m128d tn = _mm_cvtepi32_pd(_mm_cvttpd_epi32(fn));
+   __m128d n  = _mm_sub_pd(tn,_mm_and_pd(_mm_cmpgt_pd(tn,fn),_mm_set1_pd(1)));
+   __m128d r  = _mm_mul_pd(_mm_sub_pd(d,_mm_mul_pd(n,_mm_set1_pd(90))),_mm_set1_pd(PI/180));
+   __m128d x2 = _mm_mul_pd(r,r);
+   __m128d sp,cp;
+   //  Polynomials
+   if (tier==SINCOS_LOW)
+   {
+      sp = _mm_add_pd(_mm_set1_pd(S3),_mm_mul_pd(x2,_mm_set1_pd(S5)));
+      cp = _mm_add_pd(_mm_set1_pd(C2),_mm_mul_pd(x2,_mm_set1_pd(C4)));
+   }
+   else if (tier==SINCOS_MED)
+   {
+      sp = _mm_add_pd(_mm_set1_pd(S5),_mm_mul_pd(x2,_mm_set1_pd(S7)));
+      sp = _mm_add_pd(_mm_set1_pd(S3),_mm_mul_pd(x2,sp));
+      cp = _mm_add_pd(_mm_set1_pd(C4),_mm_mul_pd(x2,_mm_set1_pd(C6)));
+      cp = _mm_add_pd(_mm_set1_pd(C2),_mm_mul_pd(x2,cp));
+   }
+   else
+   {
+      sp = _mm_add_pd(_mm_set1_pd(S13),_mm_mul_pd(x2,_mm_set1_pd(S15)));
+      sp = _mm_add_pd(_mm_set1_pd(S11),_mm_mul_pd(x2,sp));
+      sp = _mm_add_pd(_mm_set1_pd(S9),_mm_mul_pd(x2,sp));
+      sp = _mm_add_pd(_mm_set1_pd(S7),_mm_mul_pd(x2,sp));
+      sp = _mm_add_pd(_mm_set1_pd(S5),_mm_mul_pd(x2,sp));
+      sp = _mm_add_pd(_mm_set1_pd(S3),_mm_mul_pd(x2,sp));
+      cp = _mm_add_pd(_mm_set1_pd(C14),_mm_mul_pd(x2,_mm_set1_pd(C16)));
+      cp = _mm_add_pd(_mm_set1_pd(C12),_mm_mul_pd(x2,cp));
+      cp = _mm_add_pd(_mm_set1_pd(C10),_mm_mul_pd(x2,cp));
+      cp = _mm_add_pd(_mm_set1_pd(C8),_mm_mul_pd(x2,cp));
+      cp = _mm_add_pd(_mm_set1_pd(C6),_mm_mul_pd(x2,cp));
+      cp = _mm_add_pd(_mm_set1_pd(C4),_mm_mul_pd(x2,cp));
+      cp = _mm_add_pd(_mm_set1_pd(C2),_mm_mul_pd(x2,cp));
+   }
+   __m128d sr = _mm_mul_pd(r,_mm_add_pd(_mm_set1_pd(1),_mm_mul_pd(x2,sp)));
+   __m128d cr = _mm_add_pd(_mm_set1_pd(1),_mm_mul_pd(x2,cp));
+   //  Quadrant of each lane copied into both halves of a 64 bit lane
+   __m128i q  = _mm_shuffle_epi32(_mm_cvttpd_epi32(n),_MM_SHUFFLE(1,1,0,0));
+   //  Odd quadrants swap sin and cos
+   __m128d swap = _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(q,one),one));
+   __m128d so = _mm_or_pd(_mm_and_pd(swap,cr),_mm_andnot_pd(swap,sr));
+   __m128d co = _mm_or_pd(_mm_and_pd(swap,sr),_mm_andnot_pd(swap,cr));
+   //  Quadrants 2,3 negate sin and quadrants 1,2 negate cos
+   __m128d ss = _mm_castsi128_pd(_mm_and_si128(_mm_slli_epi64(q,62),sign));
+   __m128d cs = _mm_castsi128_pd(_mm_and_si128(_mm_slli_epi64(_mm_add_epi32(q,_mm_set1_epi32(1)),62),sign));
+   _mm_storeu_pd(s,_mm_xor_pd(so,ss));
+   _mm_storeu_pd(c,_mm_xor_pd(co,cs));
+}
+#endif
+
+/*
+ *  Sine and cosine of n angles in degrees
+ */
+static inline void SinCosDeg(int n,const double* deg,double* s,double* c,int tier)
+{
+   int k=0;
+   if (tier==SINCOS_LIBM)
+   {
+      for (k=0;k<n;k++)
+      {
+         s[k] = Sin(deg[k]);
+         c[k] = Cos(deg[k]);
+      }
+      return;
+   }
+#ifdef __SSE2__
+   for (;k+1<n;k+=2)
+   {
+      if (fabs(deg[k])<SSE_RANGE && fabs(deg[k+1])<SSE_RANGE)
+         SinCos2(deg+k,s+k,c+k,tier);
+      else
+      {
+         SinCos1(deg[k],s+k,c+k,tier);
+         SinCos1(deg[k+1],s+k+1,c+k+1,tier);
+      }
+   }
+#endif
+   for (;k<n;k++)
+      SinCos1(deg[k],s+k,c+k,tier);
+}
+
+/*
+ *  Asynchronous frame capture (capture.c)
+ *     frames are read back through a ring of CAPRING pixel buffer objects and
+ *     written by a background thread from a queue of CAPQUEUE frames
+ */
+#define CAPRING  3
+#define CAPQUEUE 8
+
+struct frameCapture {
+   int      w,h;           //  frame size
+   int      y4m;           //  Y4M stream or PPM sequence
+   char*    name;          //  PPM file name pattern
+   FILE*    f;             //  Y4M file
+   unsigned char* line;    //  Y4M planes of one frame
+   unsigned int pbo[CAPRING];
+   int      issued;        //  reads issued into the ring
+   unsigned char* slot[CAPQUEUE];
+   int      qhead,nqueue;  //  first queued slot and number of queued slots
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t ready;
+   int      done;          //  no more frames will be queued
+   int      frames;        //  frames offered
+   int      written;       //  frames written
+   int      dropped;       //  frames dropped (queue full or wrong size)
+   int      errors;        //  write errors
+   double   readtime;      //  ms spent on the render thread
+   double   writetime;     //  ms spent writing
+   double   start,last;    //  time of the first and last frame in ms
+};
+
+struct frameCapture* CaptureCreate(const char* file,int w,int h,int fps);
+void CaptureFrame(struct frameCapture* c,int w,int h);
+void CaptureClose(struct frameCapture* c);
+
+/*
+ *  Input event record and replay, frame time statistics (input.c)
+ */
+#define INPUT_KEY     0   //  key(), a is the character
+#define INPUT_SPECIAL 1   //  special(), a is the key
+#define INPUT_RESHAPE 2   //  window size a x b
+#define INPUT_END     3   //  end of the recording
+
+struct inputEvent {
+   int      frame;         //  frame the event arrived at
+   double   t;             //  run time of the event
+   int      type;          //  INPUT_*
+   int      a,b;           //  key code or window size
+};
+
+struct inputTrace {
+   FILE*    f;             //  output file when recording
+   struct inputEvent* ev;  //  events when replaying
+   int      nev,nalloc;    //  number of events and allocated events
+   int      next;          //  next event to replay
+};
+
+struct inputTrace* InputCreate(const char* file);
+void InputWrite(struct inputTrace* in,int frame,double t,int type,int a,int b);
+struct inputTrace* InputOpen(const char* file);
+int InputNext(struct inputTrace* in,double t,struct inputEvent* ev);
+void InputClose(struct inputTrace* in,int frame,double t);
+
+#define NSTAT 3           //  simulate, draw and whole frame times
+
+struct frameStats {
+   int      n,nalloc;      //  number of frames and allocated frames
+   float*   v[NSTAT];      //  times of each frame in ms
+   FILE*    f;             //  per frame CSV output
+};
+
+struct frameStats* StatsCreate(const char* csv);
+void StatsAdd(struct frameStats* s,int frame,double t,const double* ms);
+void StatsReport(struct frameStats* s);
+
+/*
+ *  Redundant OpenGL state filter (glstate.c)
+ */
+void StEnable(GLenum cap,int on);
+void StLightfv(GLenum light,GLenum pname,const float* v);
+void StMaterialfv(GLenum face,GLenum pname,const float* v);
+void StLightModeli(GLenum pname,int v);
+void StColorMaterial(GLenum face,GLenum mode);
+void StShadeModel(GLenum mode);
+void StUseProgram(unsigned int prog);
+void StActiveTexture(GLenum unit);
+void StBindTexture(GLenum target,unsigned int tex);
+void StReset();
+void StFrame(int* issued,int* skipped);
+
+#endif